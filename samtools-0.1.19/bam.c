@@ -188,22 +188,22 @@ static void swap_endian_data(const bam1_core_t *c, int data_len, uint8_t *data)
 	}
 }
 
-int bam_read1(bamFile fp, bam1_t *b)
+// read the block length and the fixed-length core; b->data is not touched
+static int bam_read1_core(bamFile fp, bam1_t *b, int32_t *block_len)
 {
 	bam1_core_t *c = &b->core;
-	int32_t block_len, ret, i;
+	int32_t ret, i;
     uint32_t x[8];
-    int data_len;
 
 	assert(BAM_CORE_SIZE == 32);
-	if ((ret = bam_read(fp, &block_len, 4)) != 4) {
+	if ((ret = bam_read(fp, block_len, 4)) != 4) {
 		if (ret == 0) {fprintf (stderr,": EOF!\n");return -1;} // normal end-of-file
 		else return -2; // truncated
 	}
-//    fprintf (stderr,"[bam_read1] Blocklen = %d\n", block_len);
+//    fprintf (stderr,"[bam_read1] Blocklen = %d\n", *block_len);
 	if (bam_read(fp, x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
 	if (bam_is_be) {
-		bam_swap_endian_4p(&block_len);
+		bam_swap_endian_4p(block_len);
 		for (i = 0; i < 8; ++i) bam_swap_endian_4p(x + i);
 	}
 	c->tid = x[0]; c->pos = x[1];
@@ -211,20 +211,44 @@ int bam_read1(bamFile fp, bam1_t *b)
 	c->flag = x[3]>>16; c->n_cigar = x[3]&0xffff;
 	c->l_qseq = x[4];
     c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
+	return 0;
+}
+
+// read the variable-length data following the core
+static int bam_read1_data(bamFile fp, bam1_t *b, int32_t block_len)
+{
+	bam1_core_t *c = &b->core;
 	b->data_len = block_len - BAM_CORE_SIZE;
 	if (b->m_data < b->data_len) {
 		b->m_data = b->data_len;
 		kroundup32(b->m_data);
 		b->data = (uint8_t*)realloc(b->data, b->m_data);
     }
-
-    if ((data_len = bam_read(fp, b->data, b->data_len)) != b->data_len) { return -4;}
-//	fprintf (stderr," OK (%d)!\n", 4 + block_len);
+    if (bam_read(fp, b->data, b->data_len) != b->data_len) return -4;
 	b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq+1)/2;
 	if (bam_is_be) swap_endian_data(c, b->data_len, b->data);
 	if (bam_no_B) bam_remove_B(b);
-//	fprintf (stderr,"[bam_read1]\n");
-	return 4 + block_len;
+	return 0;
+}
+
+int bam_read1_filter(bamFile fp, bam1_t *b, bam_core_filter_f func, void *data)
+{
+	int32_t block_len;
+	int ret;
+	for (;;) {
+		if ((ret = bam_read1_core(fp, b, &block_len)) < 0) return ret;
+		if (func && func(data, &b->core)) { // rejected on the core: jump over the rest of the record
+			if (bam_skip(fp, block_len - BAM_CORE_SIZE) != block_len - BAM_CORE_SIZE) return -4;
+			continue;
+		}
+		if ((ret = bam_read1_data(fp, b, block_len)) < 0) return ret;
+		return 4 + block_len;
+	}
+}
+
+int bam_read1(bamFile fp, bam1_t *b)
+{
+	return bam_read1_filter(fp, b, 0, 0);
 }
 
 inline int bam_write1_core(bamFile fp, const bam1_core_t *c, int data_len, uint8_t *data)
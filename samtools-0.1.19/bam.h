@@ -56,6 +56,7 @@ typedef BGZF *bamFile;
 #define bam_dopen(fd, mode) bgzf_fdopen(fd, mode)
 #define bam_close(fp) bgzf_close(fp)
 #define bam_read(fp, buf, size) bgzf_read(fp, buf, size)
+#define bam_skip(fp, size) bgzf_skip(fp, size)
 #define bam_write(fp, buf, size) bgzf_write(fp, buf, size)
 #define bam_tell(fp) bgzf_tell(fp)
 #define bam_seek(fp, pos, dir) bgzf_seek(fp, pos, dir)
@@ -67,6 +68,7 @@ typedef gzFile bamFile;
 #define bam_dopen(fd, mode) gzdopen(fd, mode)
 #define bam_close(fp) gzclose(fp)
 #define bam_read(fp, buf, size) gzread(fp, buf, size)
+#define bam_skip(fp, size) (gzseek(fp, size, SEEK_CUR) < 0? -1 : (size))
 /* no bam_write/bam_tell/bam_seek() here */
 #endif
 
@@ -436,6 +438,28 @@ extern "C" {
 	 */
 	int bam_read1(bamFile fp, bam1_t *b);
 
+	/*! @typedef
+	  @abstract  Type of function deciding on a record from its core alone
+	  @param  data  user provided data
+	  @param  c     the core of the alignment; nothing else is loaded yet
+	  @return       non-zero to skip the alignment
+	 */
+	typedef int (*bam_core_filter_f)(void *data, const bam1_core_t *c);
+
+	/*!
+	  @abstract   Read the next alignment not rejected by a core filter
+	  @param  fp    BAM file handler
+	  @param  b     read alignment
+	  @param  func  core filter; NULL to accept all
+	  @param  data  passed to func
+	  @return       number of bytes of the returned record; negative on end-of-file or error
+
+	  @discussion The variable-length data of a rejected record is
+	  skipped in the uncompressed stream without being copied, so
+	  filters on flag, tid, position or mapQ are cheap.
+	 */
+	int bam_read1_filter(bamFile fp, bam1_t *b, bam_core_filter_f func, void *data);
+
 	int bam_remove_B(bam1_t *b);
 
 	/*!
@@ -543,13 +567,74 @@ extern "C" {
 	void bam_plp_reset(bam_plp_t iter);
 	void bam_plp_destroy(bam_plp_t iter);
 
+#define BAM_PLP_RG    0
+#define BAM_PLP_ZQ    1
+#define BAM_PLP_N_TAG 2
+	/*! @abstract  Cached bam_aux_get() of RG or ZQ (BAM_PLP_RG/BAM_PLP_ZQ)
+
+	  @discussion  The aux block of a read is scanned once while the read
+	  is in the pileup buffer, not at every column. p must come from a
+	  pileup iterator.
+	 */
+	uint8_t *bam_plp_aux_get(const bam_pileup1_t *p, int id);
+
+	/*! @typedef
+	  @abstract  Type of function computing per-read client data as a read enters the pileup buffer
+	  @param  data  the data given to bam_plp_init()/bam_mplp_init() for this file
+	  @param  b     the read, as stored in the buffer
+	 */
+	typedef int (*bam_plp_cd_f)(void *data, const bam1_t *b);
+	void bam_plp_constructor(bam_plp_t iter, bam_plp_cd_f func);
+	/*! @abstract  Client data of a piled-up read; 0 if no constructor is set */
+	int bam_plp_cd(const bam_pileup1_t *p);
+
+	/*! @typedef
+	  @abstract Struct-of-arrays block of consecutive pileup columns.
+	  @field  n       number of columns in the block
+	  @field  tid     chromosome ID of each column
+	  @field  pos     0-based coordinate of each column
+	  @field  off     reads at column i are [off[i],off[i+1]) in the flat arrays
+	  @field  base    4-bit encoded base; 0 if is_del is set
+	  @field  qual    base quality; 0 if is_del is set
+	  @field  mapq    mapping quality of the read
+	  @field  strand  1 iff the read is on the reverse strand
+	  @field  is_del  1 iff the read has a deletion or ref-skip at the column
+	  @field  qpos    same as bam_pileup1_t::qpos
+	  @field  indel   same as bam_pileup1_t::indel
+
+	  @discussion Filled by bam_plp_auto_batch(). Unlike bam_pileup1_t,
+	  the block does not keep pointers to the alignments, which are
+	  recycled by the iterator as it moves on, so all columns in the
+	  block stay valid until the next call.
+	 */
+	typedef struct {
+		int n, m, m_read;
+		int32_t *tid, *pos, *off;
+		uint8_t *base, *qual, *mapq, *strand, *is_del;
+		int32_t *qpos, *indel;
+	} bam_plp_batch_t;
+
+	bam_plp_batch_t *bam_plp_batch_init(void);
+	void bam_plp_batch_destroy(bam_plp_batch_t *bt);
+	/*! @abstract Fill up to w non-empty columns; return the number of columns, 0 at the end or -1 on error */
+	int bam_plp_auto_batch(bam_plp_t iter, int w, bam_plp_batch_t *bt);
+
 	struct __bam_mplp_t;
 	typedef struct __bam_mplp_t *bam_mplp_t;
 
 	bam_mplp_t bam_mplp_init(int n, bam_plp_auto_f func, void **data);
 	void bam_mplp_destroy(bam_mplp_t iter);
 	void bam_mplp_set_maxcnt(bam_mplp_t iter, int maxcnt);
+	void bam_mplp_constructor(bam_mplp_t iter, bam_plp_cd_f func);
 	int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp);
+	/*! @abstract  Sparse bam_mplp_auto(): return the number k of files covering the next column
+
+	  @discussion  *idx points to the k file indices in ascending order;
+	  n_plp[j] and plp[j], j<k, are the pileup of file idx[j]. Files are
+	  merged with a heap, so the cost per column depends on k, not on
+	  the total number of files.
+	 */
+	int bam_mplp_auto_sparse(bam_mplp_t iter, int *_tid, int *_pos, const int **idx, int *n_plp, const bam_pileup1_t **plp);
 
 	/*! @typedef
 	  @abstract    Type of function to be called by bam_plbuf_push().
@@ -645,6 +730,9 @@ extern "C" {
 
 	bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end);
 	int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b);
+
+	/*! @abstract  bam_iter_read() that skips records rejected by a core filter; see bam_read1_filter() */
+	int bam_iter_read_filter(bamFile fp, bam_iter_t iter, bam1_t *b, bam_core_filter_f func, void *data);
 	void bam_iter_destroy(bam_iter_t iter);
 
 	/*!
@@ -676,6 +764,8 @@ extern "C" {
 	  the corresponding type.
 	*/
 	uint8_t *bam_aux_get(const bam1_t *b, const char tag[2]);
+	/*! @abstract  Look up n tags, concatenated in tags[], in one pass; ret[i] as bam_aux_get() for the i-th tag */
+	int bam_aux_get_n(const bam1_t *b, int n, const char *tags, uint8_t **ret);
 
 	int32_t bam_aux2i(const uint8_t *s);
 	float bam_aux2f(const uint8_t *s);
@@ -710,6 +800,32 @@ extern "C" {
 	*/
 	int32_t bam_cigar2qlen(const bam1_core_t *c, const uint32_t *cigar);
 
+	/*******
+	 * BAQ *
+	 *******/
+
+	/*! @typedef
+	  @abstract Reusable buffers for computing BAQ; keep one per thread.
+	 */
+	typedef struct __bam_baq_buf_t bam_baq_buf_t;
+
+	bam_baq_buf_t *bam_baq_buf_init(void);
+	void bam_baq_buf_destroy(bam_baq_buf_t *buf);
+
+	/*!
+	  @abstract  Compute BAQ and add the BQ or ZQ tag
+	  @param  b     alignment
+	  @param  ref   reference sequence of b->core.tid
+	  @param  flag  bit 0: apply BAQ to the qualities (ZQ); bit 1: extended BAQ; bit 2: recompute an existing BQ;
+	                bit 3: leave the qualities of reads exactly matching the reference unchanged, without the HMM
+	  @param  buf   workspace from bam_baq_buf_init(), or NULL to allocate temporary buffers
+	  @return       0 on success; negative if BAQ is not applicable or already done
+	 */
+	int bam_prob_realn_buf(bam1_t *b, const char *ref, int flag, bam_baq_buf_t *buf);
+
+	/*! @abstract  Number of reads given BAQ with buf, and of those that took the fast path (flag bit 3) */
+	void bam_baq_buf_stat(const bam_baq_buf_t *buf, long *n_read, long *n_skip);
+
 #ifdef __cplusplus
 }
 #endif
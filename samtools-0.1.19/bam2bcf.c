@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
 #include "bam.h"
 #include "kstring.h"
 #include "bam2bcf.h"
@@ -8,6 +9,9 @@
 #include "bcftools/bcf.h"
 
 extern	void ks_introsort_uint32_t(size_t n, uint32_t a[]);
+struct __kt_fet_cache_t *kt_fet_cache_init(void);
+void kt_fet_cache_destroy(struct __kt_fet_cache_t *c);
+double kt_fisher_exact_r(struct __kt_fet_cache_t *c, int n11, int n12, int n21, int n22, double *_left, double *_right, double *two);
 
 #define CALL_ETA 0.03f
 #define CALL_MAX 256
@@ -31,10 +35,21 @@ bcf_callaux_t *bcf_call_init(double theta, int min_baseQ)
     bca->npos = 100;
     bca->ref_pos = calloc(bca->npos, sizeof(int));
     bca->alt_pos = calloc(bca->npos, sizeof(int));
+	bca->fet = kt_fet_cache_init();
  	return bca;
 }
 
 
+// the state depends on the site only, so downsampling is the same however the genome is split among threads
+void bcf_call_srand(bcf_callaux_t *bca, int tid, int pos)
+{
+	uint64_t x = ((uint64_t)(uint32_t)tid<<32 | (uint32_t)pos) ^ (uint64_t)(uint32_t)bca->seed * 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 33; x *= 0xff51afd7ed558ccdULL; // the finalizer of MurmurHash3
+	x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	bca->rng = x & 0xffffffffffffULL;
+}
+
 static int get_position(const bam_pileup1_t *p, int *len)
 {
     int icig, n_tot_bases = 0, iread = 0, edist = p->qpos + 1;
@@ -70,6 +85,8 @@ void bcf_call_destroy(bcf_callaux_t *bca)
 	if (bca == 0) return;
 	errmod_destroy(bca->e);
     if (bca->npos) { free(bca->ref_pos); free(bca->alt_pos); bca->npos = 0; }
+	bcf_call_realn_destroy(bca);
+	kt_fet_cache_destroy(bca->fet);
 	free(bca->bases); free(bca->inscns); free(bca);
 }
 /* ref_base is the 4-bit representation of the reference base. It is
@@ -138,14 +155,34 @@ int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t
 	}
 	r->depth = n; r->ori_depth = ori_depth;
 	// glfgen
-	errmod_cal(bca->e, n, 5, bca->bases, r->p);
+	errmod_cal_r(bca->e, n, 5, bca->bases, r->p, &bca->rng);
 	return r->depth;
 }
 
+#define MW_N 8 // calc_ReadPosBias() takes the exact test for nref<8 and nalt<8 only
+
+static double mw_tab[MW_N][MW_N][(MW_N-1)*(MW_N-1)+1]; // P(U) of n and m observations; 0 for U>n*m
+static pthread_once_t mw_once = PTHREAD_ONCE_INIT;
+
+// fill mw_tab with the recurrence below, in the same order of operations
+static void mw_init(void)
+{
+    int n, m, U;
+    for (n = 0; n < MW_N; ++n)
+        for (m = 0; m < MW_N; ++m)
+            for (U = 0; U <= n*m; ++U)
+                mw_tab[n][m][U] = n==0||m==0? (U==0? 1 : 0)
+                    : (double)n/(n+m)*(U-m<0? 0 : mw_tab[n-1][m][U-m]) + (double)m/(n+m)*(U>n*(m-1)? 0 : mw_tab[n][m-1][U]);
+}
+
 double mann_whitney_1947(int n, int m, int U)
 {
     if (U<0) return 0;
     if (n==0||m==0) return U==0 ? 1 : 0;
+    if (n<MW_N && m<MW_N) {
+        pthread_once(&mw_once, mw_init);
+        return U>n*m? 0 : mw_tab[n][m][U];
+    }
     return (double)n/(n+m)*mann_whitney_1947(n-1,m,U-m) + (double)m/(n+m)*mann_whitney_1947(n,m-1,U);
 }
 
@@ -371,12 +408,50 @@ int bcf_call_combine(int n, const bcf_callret1_t *calls, bcf_callaux_t *bca, int
 	return 0;
 }
 
+/* The FORMAT of the records, indexed by fmt_flag&7 (DP=1, SP=2, DV=4),
+   and the fields bcf_sync() would derive from it. len is 0 for PL, whose
+   length depends on the number of alleles. */
+#define B2B_ID(a, b) ((uint32_t)(a)<<8 | (b))
+static const struct {
+	const char *fmt;
+	int n_gi;
+	uint32_t id[4];
+	int len[4];
+} b2b_fmt_tmpl[8] = {
+	{ "PL",          1, { B2B_ID('P','L') }, { 0 } },
+	{ "PL:DP",       2, { B2B_ID('P','L'), B2B_ID('D','P') }, { 0, 2 } },
+	{ "PL:SP",       2, { B2B_ID('P','L'), B2B_ID('S','P') }, { 0, 4 } },
+	{ "PL:DP:SP",    3, { B2B_ID('P','L'), B2B_ID('D','P'), B2B_ID('S','P') }, { 0, 2, 4 } },
+	{ "PL:DV",       2, { B2B_ID('P','L'), B2B_ID('D','V') }, { 0, 2 } },
+	{ "PL:DP:DV",    3, { B2B_ID('P','L'), B2B_ID('D','P'), B2B_ID('D','V') }, { 0, 2, 2 } },
+	{ "PL:DV:SP",    3, { B2B_ID('P','L'), B2B_ID('D','V'), B2B_ID('S','P') }, { 0, 2, 4 } },
+	{ "PL:DP:DV:SP", 4, { B2B_ID('P','L'), B2B_ID('D','P'), B2B_ID('D','V'), B2B_ID('S','P') }, { 0, 2, 2, 4 } }
+};
+
+// the same as ksprintf(s, "%f", x): as x is a float, x*1e6 is exact in double and rint() rounds it as printf would
+static inline void kputf6(float x, kstring_t *s)
+{
+	double y = rint(fabs((double)x) * 1e6);
+	uint64_t z, d;
+	char buf[8];
+	int i;
+	if (!(y < 9e18)) { // inf, nan or too large
+		ksprintf(s, "%f", x);
+		return;
+	}
+	if (signbit(x)) kputc('-', s);
+	z = (uint64_t)y;
+	kputl((long)(z / 1000000), s);
+	for (i = 6, d = z % 1000000; i > 0; --i, d /= 10) buf[i] = '0' + d % 10;
+	buf[0] = '.';
+	kputsn(buf, 7, s);
+}
+
 int bcf_call2bcf(int tid, int pos, bcf_call_t *bc, bcf1_t *b, bcf_callret1_t *bcr, int fmt_flag,
 				 const bcf_callaux_t *bca, const char *ref)
 {
-	extern double kt_fisher_exact(int n11, int n12, int n21, int n22, double *_left, double *_right, double *two);
 	kstring_t s;
-	int i, j;
+	int i, j, n_alleles = 1, o_alt, o_info, o_fmt;
 	b->n_smpl = bc->n;
 	b->tid = tid; b->pos = pos; b->qual = 0;
 	s.s = b->str; s.m = b->m_str; s.l = 0;
@@ -387,9 +462,11 @@ int bcf_call2bcf(int tid, int pos, bcf_call_t *bc, bcf1_t *b, bcf_callret1_t *bc
 		for (j = 0; j < bca->indelreg; ++j) kputc(ref[pos+1+j], &s);
 		kputc('\0', &s);
 		// write ALT
+		o_alt = s.l;
 		kputc(ref[pos], &s);
 		for (i = 1; i < 4; ++i) {
 			if (bc->a[i] < 0) break;
+			++n_alleles;
 			if (i > 1) {
 				kputc(',', &s); kputc(ref[pos], &s);
 			}
@@ -406,8 +483,10 @@ int bcf_call2bcf(int tid, int pos, bcf_call_t *bc, bcf1_t *b, bcf_callret1_t *bc
 		kputc('\0', &s);
 	} else { // a SNP
 		kputc("ACGTN"[bc->ori_ref], &s); kputc('\0', &s);
+		o_alt = s.l;
 		for (i = 1; i < 5; ++i) {
 			if (bc->a[i] < 0) break;
+			++n_alleles;
 			if (i > 1) kputc(',', &s);
 			kputc(bc->unseen == i? 'X' : "ACGT"[bc->a[i]], &s);
 		}
@@ -415,6 +494,7 @@ int bcf_call2bcf(int tid, int pos, bcf_call_t *bc, bcf1_t *b, bcf_callret1_t *bc
 	}
 	kputc('\0', &s);
 	// INFO
+	o_info = s.l;
 	if (bc->ori_ref < 0) ksprintf(&s,"INDEL;IS=%d,%f;", bca->max_support, bca->max_frac);
 	kputs("DP=", &s); kputw(bc->ori_depth, &s); kputs(";I16=", &s);
 	for (i = 0; i < 16; ++i) {
@@ -422,22 +502,39 @@ int bcf_call2bcf(int tid, int pos, bcf_call_t *bc, bcf1_t *b, bcf_callret1_t *bc
 		kputw(bc->anno[i], &s);
 	}
     //ksprintf(&s,";RPS=%d,%f,%f", bc->read_pos.dp,bc->read_pos.avg,bc->read_pos.var);
-    ksprintf(&s,";QS=%f,%f,%f,%f", bc->qsum[0],bc->qsum[1],bc->qsum[2],bc->qsum[3]);
+    kputs(";QS=", &s);
+    for (i = 0; i < 4; ++i) {
+        if (i) kputc(',', &s);
+        kputf6(bc->qsum[i], &s);
+    }
     if (bc->vdb != -1)
         ksprintf(&s, ";VDB=%e", bc->vdb);
     if (bc->read_pos_bias != -1 )
         ksprintf(&s, ";RPB=%e", bc->read_pos_bias);
 	kputc('\0', &s);
-	// FMT
-	kputs("PL", &s);
-	if (bcr && fmt_flag) {
-		if (fmt_flag & B2B_FMT_DP) kputs(":DP", &s);
-		if (fmt_flag & B2B_FMT_DV) kputs(":DV", &s);
-		if (fmt_flag & B2B_FMT_SP) kputs(":SP", &s);
-	}
-	kputc('\0', &s);
+	// FMT; the fields below are set as bcf_sync() would, without parsing the string back
+	o_fmt = s.l;
+	j = bcr? fmt_flag & 7 : 0;
+	kputsn(b2b_fmt_tmpl[j].fmt, strlen(b2b_fmt_tmpl[j].fmt) + 1, &s);
 	b->m_str = s.m; b->str = s.s; b->l_str = s.l;
-	bcf_sync(b);
+	b->ref = b->str + 1; b->alt = b->str + o_alt; b->flt = b->str + o_info - 1;
+	b->info = b->str + o_info; b->fmt = b->str + o_fmt;
+	b->n_alleles = n_alleles;
+	b->n_gi = b2b_fmt_tmpl[j].n_gi;
+	if (b->n_gi > b->m_gi) {
+		b->gi = realloc(b->gi, 4 * sizeof(bcf_ginfo_t));
+		memset(b->gi + b->m_gi, 0, (4 - b->m_gi) * sizeof(bcf_ginfo_t));
+		b->m_gi = 4;
+	}
+	for (i = 0; i < b->n_gi; ++i) {
+		bcf_ginfo_t *g = &b->gi[i];
+		g->fmt = b2b_fmt_tmpl[j].id[i];
+		g->len = i? b2b_fmt_tmpl[j].len[i] : n_alleles * (n_alleles + 1) / 2;
+		if (g->len * bc->n > g->m_data) {
+			g->m_data = g->len * bc->n;
+			g->data = realloc(g->data, g->m_data);
+		}
+	}
 	memcpy(b->gi[0].data, bc->PL, b->gi[0].len * bc->n);
 	if (bcr && fmt_flag) {
 		uint16_t *dp = (fmt_flag & B2B_FMT_DP)? b->gi[1].data : 0;
@@ -455,7 +552,7 @@ int bcf_call2bcf(int tid, int pos, bcf_call_t *bc, bcf1_t *b, bcf_callret1_t *bc
 				} else {
 					double left, right, two;
 					int x;
-					kt_fisher_exact(p->anno[0], p->anno[1], p->anno[2], p->anno[3], &left, &right, &two);
+					kt_fisher_exact_r(bca? bca->fet : 0, p->anno[0], p->anno[1], p->anno[2], p->anno[3], &left, &right, &two);
 					x = (int)(-4.343 * log(two) + .499);
 					if (x > 255) x = 255;
 					sp[i] = x;
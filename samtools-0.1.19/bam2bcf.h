@@ -27,6 +27,14 @@ typedef struct __bcf_callaux_t {
 	uint16_t *bases;
 	errmod_t *e;
 	void *rghash;
+	int seed; // with the position, seeds rng at each site
+	uint64_t rng; // state of ks_drand48_r() downsampling deep columns
+	struct __kt_pool_t *pool; // threads sharing the realignment at large indel sites; may be NULL
+	// scratch of bcf_call_gap_prep(), kept from site to site
+	void *realn_cache; // read windows seen at the current site
+	void *realn_tmp; // workspace of each thread of pool
+	long n_realn, n_realn_hit; // reads realigned, and those whose scores came from realn_cache
+	struct __kt_fet_cache_t *fet; // Fisher tests of the SP strand tables, which recur from site to site
 } bcf_callaux_t;
 
 typedef struct {
@@ -53,12 +61,14 @@ extern "C" {
 
 	bcf_callaux_t *bcf_call_init(double theta, int min_baseQ);
 	void bcf_call_destroy(bcf_callaux_t *bca);
+	void bcf_call_srand(bcf_callaux_t *bca, int tid, int pos);
 	int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r);
 	int bcf_call_combine(int n, const bcf_callret1_t *calls, bcf_callaux_t *bca, int ref_base /*4-bit*/, bcf_call_t *call);
 	int bcf_call2bcf(int tid, int pos, bcf_call_t *bc, bcf1_t *b, bcf_callret1_t *bcr, int fmt_flag,
 					 const bcf_callaux_t *bca, const char *ref);
 	int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_callaux_t *bca, const char *ref,
 						  const void *rghash);
+	void bcf_call_realn_destroy(bcf_callaux_t *bca);
 
 #ifdef __cplusplus
 }
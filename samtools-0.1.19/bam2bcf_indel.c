@@ -5,8 +5,11 @@
 #include "bam2bcf.h"
 #include "kaln.h"
 #include "kprobaln.h"
+#include "kthread.h"
 #include "khash.h"
+#include "kstring.h"
 KHASH_SET_INIT_STR(rg)
+KHASH_MAP_INIT_INT64(realn, int)
 
 #include "ksort.h"
 KSORT_INIT_GENERIC(uint32_t)
@@ -109,6 +112,145 @@ static inline int est_indelreg(int pos, const char *ref, int l, char *ins4)
 	return max_i - pos;
 }
 
+#define REALN_PAR_MIN 512 // min reads x types at a site to share the realignment among bca->pool
+
+/* Reads carrying the same bases and capped qualities over the same window
+   of the same sample get the same realignment scores; at deep sites, PCR
+   duplicates and amplicons make this common. The cache maps the hash of
+   such a window to the first read that had it and only lives for one site.
+   The key of a read to realign also holds its query and qualities. */
+typedef struct {
+	size_t key_off; // in key.s
+	int key_len, K;
+} realn_ent_t;
+
+typedef struct { // a read to realign against the haplotypes of its sample
+	int K, tbeg, tend, l_query;
+	size_t key_off;
+} realn_job_t;
+
+typedef struct {
+	khash_t(realn) *h; // hash of a key -> index in ent[]
+	int n, m, n_job, m_job, n_hit, m_hit;
+	realn_ent_t *ent;
+	realn_job_t *job;
+	int *hit; // pairs of a read and the first read with its window
+	kstring_t key; // keys of all entries and jobs, back to back
+} realn_cache_t;
+
+typedef struct { // per-thread workspace; there are fewer than 64 types
+	kpa_buf_t *kpa;
+	const uint8_t *hap[64];
+	int l_hap[64], sc1[64], sc2[64], t2[64];
+	kpa_par_t apf[64];
+} realn_tmp_t;
+
+static realn_cache_t *realn_cache_reset(void *_rc)
+{
+	realn_cache_t *rc = (realn_cache_t*)_rc;
+	if (rc == 0) {
+		rc = calloc(1, sizeof(realn_cache_t));
+		rc->h = kh_init(realn);
+	}
+	kh_clear(realn, rc->h);
+	rc->n = rc->n_job = 0, rc->key.l = 0;
+	return rc;
+}
+
+void bcf_call_realn_destroy(bcf_callaux_t *bca)
+{
+	realn_cache_t *rc = (realn_cache_t*)bca->realn_cache;
+	realn_tmp_t *tmp = (realn_tmp_t*)bca->realn_tmp;
+	int i;
+	if (rc) {
+		kh_destroy(realn, rc->h);
+		free(rc->ent); free(rc->job); free(rc->hit); free(rc->key.s); free(rc);
+	}
+	if (tmp) {
+		for (i = 0; i < kt_pool_size(bca->pool); ++i) kpa_buf_destroy(tmp[i].kpa);
+		free(tmp);
+	}
+	bca->realn_cache = bca->realn_tmp = 0;
+}
+
+static inline uint64_t realn_hash(const uint8_t *s, int l)
+{
+	uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+	int i;
+	for (i = 0; i < l; ++i) h = (h ^ s[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/* The key is the last key_len bytes of rc->key. Return the first read with
+   the same key at this site and drop the key, or return -1 and keep it; read
+   K is then recorded as the first one unless another key has the same hash. */
+static int realn_cache_get(realn_cache_t *rc, int key_len, int K)
+{
+	const char *key = rc->key.s + rc->key.l - key_len;
+	uint64_t hv = realn_hash((const uint8_t*)key, key_len);
+	khint_t k;
+	int absent;
+	k = kh_put(realn, rc->h, hv, &absent);
+	if (!absent) {
+		realn_ent_t *e = &rc->ent[kh_val(rc->h, k)];
+		if (e->key_len != key_len || memcmp(rc->key.s + e->key_off, key, key_len) != 0) return -1;
+		rc->key.l -= key_len;
+		return e->K;
+	}
+	if (rc->n == rc->m) {
+		rc->m = rc->m? rc->m<<1 : 16;
+		rc->ent = realloc(rc->ent, rc->m * sizeof(realn_ent_t));
+	}
+	rc->ent[rc->n].key_off = rc->key.l - key_len;
+	rc->ent[rc->n].key_len = key_len;
+	rc->ent[rc->n].K = K;
+	kh_val(rc->h, k) = rc->n++;
+	return -1;
+}
+
+typedef struct { // what the realignment of one sample at a site shares
+	int n_types, left, max_ref2;
+	const int *types;
+	const char *ref2;
+	const kpa_par_t *apf1, *apf2;
+	const realn_cache_t *rc;
+	int *score1, *score2;
+	realn_tmp_t *tmp;
+} realn_shared_t;
+
+// score job j against the haplotypes of all types; called from thread tid of bca->pool
+static void realn_worker(void *data, long j, int tid)
+{
+	realn_shared_t *w = (realn_shared_t*)data;
+	const realn_job_t *job = &w->rc->job[j];
+	const uint8_t *query = (const uint8_t*)w->rc->key.s + job->key_off, *qq = query + job->l_query;
+	realn_tmp_t *tmp = &w->tmp[tid];
+	int t, kk, l, n2, n_types = w->n_types, *score1 = &w->score1[job->K * n_types], *score2 = &w->score2[job->K * n_types];
+	for (t = 0; t < n_types; ++t) {
+		int tb = job->tbeg;
+		if (w->types[t] < 0) tb = tb + w->types[t] > w->left? tb + w->types[t] : w->left; // a deletion is aligned from further left
+		tmp->hap[t] = (uint8_t*)w->ref2 + t * w->max_ref2 + tb - w->left;
+		tmp->l_hap[t] = job->tend - tb + abs(w->types[t]);
+	}
+	// do realignment; this is the bottleneck
+	kpa_glocal_score(tmp->kpa, n_types, tmp->hap, tmp->l_hap, query, job->l_query, qq, w->apf1, tmp->sc1);
+	for (t = n2 = 0; t < n_types; ++t) {
+		l = (int)(100. * tmp->sc1[t] / job->l_query + .499); // used for adjusting indelQ below
+		if (l > 255) l = 255;
+		score1[t] = score2[t] = tmp->sc1[t]<<8 | l;
+		if (tmp->sc1[t] > 5) { // realign with the stricter gap model
+			tmp->hap[n2] = tmp->hap[t], tmp->l_hap[n2] = tmp->l_hap[t];
+			tmp->apf[n2] = w->apf2[t], tmp->t2[n2++] = t;
+		}
+	}
+	kpa_glocal_score(tmp->kpa, n2, tmp->hap, tmp->l_hap, query, job->l_query, qq, tmp->apf, tmp->sc2);
+	for (kk = 0; kk < n2; ++kk) {
+		l = (int)(100. * tmp->sc2[kk] / job->l_query + .499);
+		if (l > 255) l = 255;
+		score2[tmp->t2[kk]] = tmp->sc2[kk]<<8 | l;
+	}
+}
+
 /*
  *  @n:  number of samples
  */
@@ -117,7 +259,9 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 {
 	int i, s, j, k, t, n_types, *types, max_rd_len, left, right, max_ins, *score1, *score2, max_ref2;
 	int N, K, l_run, ref_type, n_alt;
-	char *inscns = 0, *ref2, *query, **ref_sample;
+	char *inscns = 0, *ref2, **ref_sample;
+	kpa_par_t *apf1, *apf2;
+	realn_cache_t *rc;
 	khash_t(rg) *hash = (khash_t(rg)*)rghash;
 	if (ref == 0 || bca == 0) return -1;
 	// mark filtered reads
@@ -126,7 +270,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 		for (s = N = 0; s < n; ++s) {
 			for (i = 0; i < n_plp[s]; ++i) {
 				bam_pileup1_t *p = plp[s] + i;
-				const uint8_t *rg = bam_aux_get(p->b, "RG");
+				const uint8_t *rg = bam_plp_aux_get(p, BAM_PLP_RG);
 				p->aux = 1; // filtered by default
 				if (rg) {
 					khint_t k = kh_get(rg, hash, (const char*)(rg + 1));
@@ -317,92 +461,107 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 	}
 	// compute the likelihood given each type of indel for each read
 	max_ref2 = right - left + 2 + 2 * (max_ins > -types[0]? max_ins : -types[0]);
-	ref2  = calloc(max_ref2, 1);
-	query = calloc(right - left + max_rd_len + max_ins + 2, 1);
+	ref2  = calloc(max_ref2 * n_types, 1); // one haplotype per type
 	score1 = calloc(N * n_types, sizeof(int));
 	score2 = calloc(N * n_types, sizeof(int));
+	apf1 = alloca(n_types * sizeof(kpa_par_t)); apf2 = alloca(n_types * sizeof(kpa_par_t));
+	rc = bca->realn_cache = realn_cache_reset(bca->realn_cache);
+	if (bca->realn_tmp == 0) {
+		realn_tmp_t *tmp;
+		tmp = bca->realn_tmp = calloc(kt_pool_size(bca->pool), sizeof(realn_tmp_t));
+		for (i = 0; i < kt_pool_size(bca->pool); ++i) tmp[i].kpa = kpa_buf_init();
+	}
 	bca->indelreg = 0;
 	for (t = 0; t < n_types; ++t) {
-		int l, ir;
-		kpa_par_t apf1 = { 1e-4, 1e-2, 10 }, apf2 = { 1e-6, 1e-3, 10 };
-		apf1.bw = apf2.bw = abs(types[t]) + 3;
+		int ir;
+		kpa_par_t a1 = { 1e-4, 1e-2, 10 }, a2 = { 1e-6, 1e-3, 10 };
+		a1.bw = a2.bw = abs(types[t]) + 3;
+		apf1[t] = a1, apf2[t] = a2;
 		// compute indelreg
 		if (types[t] == 0) ir = 0;
 		else if (types[t] > 0) ir = est_indelreg(pos, ref, types[t], &inscns[t*max_ins]);
 		else ir = est_indelreg(pos, ref, -types[t], 0);
 		if (ir > bca->indelreg) bca->indelreg = ir;
 //		fprintf(stderr, "%d, %d, %d\n", pos, types[t], ir);
-		// realignment
-		for (s = K = 0; s < n; ++s) {
-			// write ref2
+	}
+	// realignment
+	for (s = K = 0; s < n; ++s) {
+		realn_shared_t w;
+		for (t = 0; t < n_types; ++t) { // write the haplotype of each type to ref2
+			char *r2 = ref2 + t * max_ref2;
+			int l;
 			for (k = 0, j = left; j <= pos; ++j)
-				ref2[k++] = bam_nt16_nt4_table[(int)ref_sample[s][j-left]];
+				r2[k++] = bam_nt16_nt4_table[(int)ref_sample[s][j-left]];
 			if (types[t] <= 0) j += -types[t];
 			else for (l = 0; l < types[t]; ++l)
-					 ref2[k++] = inscns[t*max_ins + l];
-			for (; j < right && ref[j]; ++j)
-				ref2[k++] = bam_nt16_nt4_table[(int)ref_sample[s][j-left]];
-			for (; k < max_ref2; ++k) ref2[k] = 4;
-			if (j < right) right = j;
-			// align each read to ref2
-			for (i = 0; i < n_plp[s]; ++i, ++K) {
-				bam_pileup1_t *p = plp[s] + i;
-				int qbeg, qend, tbeg, tend, sc, kk;
-				uint8_t *seq = bam1_seq(p->b);
-				uint32_t *cigar = bam1_cigar(p->b);
-				if (p->b->core.flag&4) continue; // unmapped reads
-				// FIXME: the following loop should be better moved outside; nonetheless, realignment should be much slower anyway.
-				for (kk = 0; kk < p->b->core.n_cigar; ++kk)
-					if ((cigar[kk]&BAM_CIGAR_MASK) == BAM_CREF_SKIP) break;
-				if (kk < p->b->core.n_cigar) continue;
-				// FIXME: the following skips soft clips, but using them may be more sensitive.
-				// determine the start and end of sequences for alignment
-				qbeg = tpos2qpos(&p->b->core, bam1_cigar(p->b), left,  0, &tbeg);
-				qend = tpos2qpos(&p->b->core, bam1_cigar(p->b), right, 1, &tend);
-				if (types[t] < 0) {
-					int l = -types[t];
-					tbeg = tbeg - l > left?  tbeg - l : left;
-				}
-				// write the query sequence
-				for (l = qbeg; l < qend; ++l)
-					query[l - qbeg] = bam_nt16_nt4_table[bam1_seqi(seq, l)];
-				{ // do realignment; this is the bottleneck
-					const uint8_t *qual = bam1_qual(p->b), *bq;
-					uint8_t *qq;
-					qq = calloc(qend - qbeg, 1);
-					bq = (uint8_t*)bam_aux_get(p->b, "ZQ");
-					if (bq) ++bq; // skip type
-					for (l = qbeg; l < qend; ++l) {
-						qq[l - qbeg] = bq? qual[l] + (bq[l] - 64) : qual[l];
-						if (qq[l - qbeg] > 30) qq[l - qbeg] = 30;
-						if (qq[l - qbeg] < 7) qq[l - qbeg] = 7;
-					}
-					sc = kpa_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-									(uint8_t*)query, qend - qbeg, qq, &apf1, 0, 0);
-					l = (int)(100. * sc / (qend - qbeg) + .499); // used for adjusting indelQ below
-					if (l > 255) l = 255;
-					score1[K*n_types + t] = score2[K*n_types + t] = sc<<8 | l;
-					if (sc > 5) {
-						sc = kpa_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-										(uint8_t*)query, qend - qbeg, qq, &apf2, 0, 0);
-						l = (int)(100. * sc / (qend - qbeg) + .499);
-						if (l > 255) l = 255;
-						score2[K*n_types + t] = sc<<8 | l;
-					}
-					free(qq);
+					 r2[k++] = inscns[t*max_ins + l];
+			for (; j < right && ref[j]; ++j) // right never moves: ref[] has no NUL before it
+				r2[k++] = bam_nt16_nt4_table[(int)ref_sample[s][j-left]];
+			for (; k < max_ref2; ++k) r2[k] = 4;
+		}
+		// collect the reads to align, leaving out those whose window has been seen at this site
+		rc->n_job = rc->n_hit = 0;
+		for (i = 0; i < n_plp[s]; ++i, ++K) {
+			bam_pileup1_t *p = plp[s] + i;
+			int qbeg, qend, tbeg, tend, l, kk, hdr[4];
+			uint8_t *seq = bam1_seq(p->b), *query, *qq;
+			const uint8_t *qual = bam1_qual(p->b), *bq;
+			uint32_t *cigar = bam1_cigar(p->b);
+			realn_job_t *job;
+			if (p->b->core.flag&4) continue; // unmapped reads
+			for (kk = 0; kk < p->b->core.n_cigar; ++kk)
+				if ((cigar[kk]&BAM_CIGAR_MASK) == BAM_CREF_SKIP) break;
+			if (kk < p->b->core.n_cigar) continue;
+			// FIXME: the following skips soft clips, but using them may be more sensitive.
+			// determine the start and end of sequences for alignment
+			qbeg = tpos2qpos(&p->b->core, bam1_cigar(p->b), left,  0, &tbeg);
+			qend = tpos2qpos(&p->b->core, bam1_cigar(p->b), right, 1, &tend);
+			// the key: sample, window, the query sequence and its base qualities with BAQ, capped
+			hdr[0] = s, hdr[1] = tbeg - left, hdr[2] = tend - left, hdr[3] = qend - qbeg;
+			kputsn((char*)hdr, sizeof(hdr), &rc->key);
+			ks_resize(&rc->key, rc->key.l + 2 * (qend - qbeg) + 1);
+			query = (uint8_t*)rc->key.s + rc->key.l; qq = query + (qend - qbeg);
+			rc->key.l += 2 * (qend - qbeg);
+			for (l = qbeg; l < qend; ++l)
+				query[l - qbeg] = bam_nt16_nt4_table[bam1_seqi(seq, l)];
+			bq = bam_plp_aux_get(p, BAM_PLP_ZQ);
+			if (bq) ++bq; // skip type
+			for (l = qbeg; l < qend; ++l) {
+				qq[l - qbeg] = bq? qual[l] + (bq[l] - 64) : qual[l];
+				if (qq[l - qbeg] > 30) qq[l - qbeg] = 30;
+				if (qq[l - qbeg] < 7) qq[l - qbeg] = 7;
+			}
+			++bca->n_realn;
+			if ((l = realn_cache_get(rc, sizeof(hdr) + 2 * (qend - qbeg), K)) >= 0) {
+				++bca->n_realn_hit;
+				if (rc->n_hit == rc->m_hit) {
+					rc->m_hit = rc->m_hit? rc->m_hit<<1 : 16;
+					rc->hit = realloc(rc->hit, rc->m_hit * 2 * sizeof(int));
 				}
-/*
-				for (l = 0; l < tend - tbeg + abs(types[t]); ++l)
-					fputc("ACGTN"[(int)ref2[tbeg-left+l]], stderr);
-				fputc('\n', stderr);
-				for (l = 0; l < qend - qbeg; ++l) fputc("ACGTN"[(int)query[l]], stderr);
-				fputc('\n', stderr);
-				fprintf(stderr, "pos=%d type=%d read=%d:%d name=%s qbeg=%d tbeg=%d score=%d\n", pos, types[t], s, i, bam1_qname(p->b), qbeg, tbeg, sc);
-*/
+				rc->hit[rc->n_hit*2] = K, rc->hit[rc->n_hit*2+1] = l;
+				++rc->n_hit;
+				continue;
 			}
+			if (rc->n_job == rc->m_job) {
+				rc->m_job = rc->m_job? rc->m_job<<1 : 16;
+				rc->job = realloc(rc->job, rc->m_job * sizeof(realn_job_t));
+			}
+			job = &rc->job[rc->n_job++];
+			job->K = K, job->tbeg = tbeg, job->tend = tend, job->l_query = qend - qbeg;
+			job->key_off = rc->key.l - 2 * (qend - qbeg);
+		}
+		// align; large sites are shared among the threads of bca->pool
+		w.n_types = n_types, w.left = left, w.max_ref2 = max_ref2;
+		w.types = types, w.ref2 = ref2, w.apf1 = apf1, w.apf2 = apf2, w.rc = rc;
+		w.score1 = score1, w.score2 = score2, w.tmp = (realn_tmp_t*)bca->realn_tmp;
+		kt_pool_for(N * n_types >= REALN_PAR_MIN? bca->pool : 0, realn_worker, &w, rc->n_job);
+		for (i = 0; i < rc->n_hit; ++i) {
+			int *h = &rc->hit[i*2];
+			memcpy(&score1[h[0]*n_types], &score1[h[1]*n_types], n_types * sizeof(int));
+			memcpy(&score2[h[0]*n_types], &score2[h[1]*n_types], n_types * sizeof(int));
 		}
 	}
-	free(ref2); free(query);
+	free(ref2);
 	{ // compute indelQ
 		int *sc, tmp, *sumq;
 		sc   = alloca(n_types * sizeof(int));
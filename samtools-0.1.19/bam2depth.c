@@ -10,6 +10,8 @@
 #include <unistd.h>
 #include "bam.h"
 
+#define DEPTH_BATCH_W 1024 // columns per bam_plp_auto_batch() call
+
 typedef struct {     // auxiliary data structure
 	bamFile fp;      // the file handler
 	bam_iter_t iter; // NULL if a region not specified
@@ -104,28 +106,49 @@ int main_depth(int argc, char *argv[])
 		}
 	}
 
-	// the core multi-pileup loop
-	mplp = bam_mplp_init(n, read_bam, (void**)data); // initialization
-	bam_mplp_set_maxcnt(mplp,1000000); // set maxdepth to 1M
-	n_plp = calloc(n, sizeof(int)); // n_plp[i] is the number of covering reads from the i-th BAM
-	plp = calloc(n, sizeof(void*)); // plp[i] points to the array of covering reads (internal in mplp)
-	while (bam_mplp_auto(mplp, &tid, &pos, n_plp, plp) > 0) { // come to the next covered position
-		if (pos < beg || pos >= end) continue; // out of range; skip
-		if (bed && bed_overlap(bed, h->target_name[tid], pos, pos + 1) == 0) continue; // not in BED; skip
-		fputs(h->target_name[tid], stdout); printf("\t%d", pos+1); // a customized printf() would be faster
-		for (i = 0; i < n; ++i) { // base level filters have to go here
-			int j, m = 0;
-			for (j = 0; j < n_plp[i]; ++j) {
-				const bam_pileup1_t *p = plp[i] + j; // DON'T modfity plp[][] unless you really know
-				if (p->is_del || p->is_refskip) ++m; // having dels or refskips at tid:pos
-				else if (bam1_qual(p->b)[p->qpos] < baseQ) ++m; // low base quality
+	if (n == 1) { // single BAM: take columns in blocks and count with flat loops
+		bam_plp_t iter = bam_plp_init(read_bam, data[0]);
+		bam_plp_batch_t *bt = bam_plp_batch_init();
+		int k;
+		bam_plp_set_maxcnt(iter, 1000000);
+		while (bam_plp_auto_batch(iter, DEPTH_BATCH_W, bt) > 0) {
+			for (k = 0; k < bt->n; ++k) {
+				int j, m = 0;
+				pos = bt->pos[k];
+				if (pos < beg || pos >= end) continue;
+				if (bed && bed_overlap(bed, h->target_name[bt->tid[k]], pos, pos + 1) == 0) continue;
+				for (j = bt->off[k]; j < bt->off[k+1]; ++j)
+					m += (bt->is_del[j] || bt->qual[j] < baseQ);
+				fputs(h->target_name[bt->tid[k]], stdout);
+				printf("\t%d\t%d\n", pos+1, bt->off[k+1] - bt->off[k] - m);
+			}
+		}
+		bam_plp_batch_destroy(bt);
+		bam_plp_destroy(iter);
+	} else {
+		// the core multi-pileup loop
+		mplp = bam_mplp_init(n, read_bam, (void**)data); // initialization
+		bam_mplp_set_maxcnt(mplp,1000000); // set maxdepth to 1M
+		n_plp = calloc(n, sizeof(int)); // n_plp[i] is the number of covering reads from the i-th BAM
+		plp = calloc(n, sizeof(void*)); // plp[i] points to the array of covering reads (internal in mplp)
+		while (bam_mplp_auto(mplp, &tid, &pos, n_plp, plp) > 0) { // come to the next covered position
+			if (pos < beg || pos >= end) continue; // out of range; skip
+			if (bed && bed_overlap(bed, h->target_name[tid], pos, pos + 1) == 0) continue; // not in BED; skip
+			fputs(h->target_name[tid], stdout); printf("\t%d", pos+1); // a customized printf() would be faster
+			for (i = 0; i < n; ++i) { // base level filters have to go here
+				int j, m = 0;
+				for (j = 0; j < n_plp[i]; ++j) {
+					const bam_pileup1_t *p = plp[i] + j; // DON'T modfity plp[][] unless you really know
+					if (p->is_del || p->is_refskip) ++m; // having dels or refskips at tid:pos
+					else if (bam1_qual(p->b)[p->qpos] < baseQ) ++m; // low base quality
+				}
+				printf("\t%d", n_plp[i] - m); // this the depth to output
 			}
-			printf("\t%d", n_plp[i] - m); // this the depth to output
+			putchar('\n');
 		}
-		putchar('\n');
+		free(n_plp); free(plp);
+		bam_mplp_destroy(mplp);
 	}
-	free(n_plp); free(plp);
-	bam_mplp_destroy(mplp);
 
 	bam_header_destroy(h);
 	for (i = 0; i < n; ++i) {
@@ -46,6 +46,25 @@ uint8_t *bam_aux_get(const bam1_t *b, const char tag[2])
 	}
 	return 0;
 }
+int bam_aux_get_n(const bam1_t *b, int n, const char *tags, uint8_t **ret)
+{
+	uint8_t *s;
+	int i, n_found = 0;
+	for (i = 0; i < n; ++i) ret[i] = 0;
+	s = bam1_aux(b);
+	while (s < b->data + b->data_len && n_found < n) {
+		int x = (int)s[0]<<8 | s[1];
+		s += 2;
+		for (i = 0; i < n; ++i)
+			if (ret[i] == 0 && x == (tags[i<<1]<<8 | tags[i<<1|1])) { // the first hit, as bam_aux_get()
+				ret[i] = s; ++n_found;
+				break;
+			}
+		__skip_tag(s);
+	}
+	return n_found;
+}
+
 // s MUST BE returned by bam_aux_get()
 int bam_aux_del(bam1_t *b, uint8_t *s)
 {
@@ -679,15 +679,42 @@ void bam_iter_destroy(bam_iter_t iter)
 	if (iter) { free(iter->off); free(iter); }
 }
 
+typedef struct {
+	bamFile fp;
+	bam_iter_t iter;
+	bam_core_filter_f func;
+	void *data;
+} iter_filter_t;
+
+/* Records past the region are always loaded, so that the end of the
+ * region can be validated, and so is the first record past the current
+ * chunk, so that bam_iter_read_filter() jumps to the next chunk. A
+ * record starts before the chunk end iff the offset after its core is
+ * below the chunk end. */
+static int iter_core_filter(void *data, const bam1_core_t *c)
+{
+	iter_filter_t *f = (iter_filter_t*)data;
+	if (c->tid != f->iter->tid || c->pos >= f->iter->end) return 0;
+	if (bam_tell(f->fp) >= f->iter->off[f->iter->i].v) return 0;
+	return f->func(f->data, c);
+}
+
 int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
+{
+	return bam_iter_read_filter(fp, iter, b, 0, 0);
+}
+
+int bam_iter_read_filter(bamFile fp, bam_iter_t iter, bam1_t *b, bam_core_filter_f func, void *data)
 {
 	int ret;
+	iter_filter_t f;
 	if (iter && iter->finished) return -1;
 	if (iter == 0 || iter->from_first) {
-		ret = bam_read1(fp, b);
+		ret = bam_read1_filter(fp, b, func, data);
 		if (ret < 0 && iter) iter->finished = 1;
 		return ret;
 	}
+	f.fp = fp, f.iter = iter, f.func = func, f.data = data;
 	if (iter->off == 0) return -1;
 	for (;;) {
 		if (iter->curr_off == 0 || iter->curr_off >= iter->off[iter->i].v) { // then jump to the next chunk
@@ -699,7 +726,7 @@ int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
 			}
 			++iter->i;
 		}
-		if ((ret = bam_read1(fp, b)) >= 0) {
+		if ((ret = func? bam_read1_filter(fp, b, iter_core_filter, &f) : bam_read1(fp, b)) >= 0) {
 			iter->curr_off = bam_tell(fp);
 			if (b->core.tid != iter->tid || b->core.pos >= iter->end) { // no need to proceed
 				ret = bam_validate1(NULL, b)? -1 : -5; // determine whether end of region or error
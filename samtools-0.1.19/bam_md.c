@@ -186,17 +186,86 @@ int bam_cap_mapQ(bam1_t *b, char *ref, int thres)
 	return (int)(t + .499);
 }
 
+struct __bam_baq_buf_t {
+	int m_q, m_r; // capacities of the query- and reference-length arrays
+	long n_read, n_skip; // reads seen by BAQ and those that skipped the HMM
+	uint8_t *bq, *s, *q, *left, *rght, *r;
+	int *state;
+	kpa_buf_t *kpa;
+};
+
+bam_baq_buf_t *bam_baq_buf_init(void)
+{
+	bam_baq_buf_t *buf = calloc(1, sizeof(bam_baq_buf_t));
+	buf->kpa = kpa_buf_init();
+	return buf;
+}
+
+void bam_baq_buf_destroy(bam_baq_buf_t *buf)
+{
+	if (buf == 0) return;
+	free(buf->bq); free(buf->s); free(buf->q); free(buf->left); free(buf->rght); free(buf->r);
+	free(buf->state); kpa_buf_destroy(buf->kpa);
+	free(buf);
+}
+
+static void baq_buf_resize(bam_baq_buf_t *buf, int l_qseq, int l_ref)
+{
+	if (l_qseq + 1 > buf->m_q) {
+		buf->m_q = l_qseq + 1; kroundup32(buf->m_q);
+		buf->bq = realloc(buf->bq, buf->m_q); buf->s = realloc(buf->s, buf->m_q);
+		buf->q = realloc(buf->q, buf->m_q); buf->left = realloc(buf->left, buf->m_q);
+		buf->rght = realloc(buf->rght, buf->m_q); buf->state = realloc(buf->state, buf->m_q * sizeof(int));
+	}
+	if (l_ref > buf->m_r) {
+		buf->m_r = l_ref; kroundup32(buf->m_r);
+		buf->r = realloc(buf->r, buf->m_r);
+	}
+}
+
+void bam_baq_buf_stat(const bam_baq_buf_t *buf, long *n_read, long *n_skip)
+{
+	*n_read = buf->n_read; *n_skip = buf->n_skip;
+}
+
+// whether b is unclipped, gap-free and identical to the reference
+static int baq_is_exact(const bam1_t *b, const char *ref)
+{
+	const uint32_t *cigar = bam1_cigar(b);
+	const uint8_t *seq = bam1_seq(b);
+	int k, i, x = b->core.pos, y = 0;
+	for (k = 0; k < b->core.n_cigar; ++k) {
+		int op = cigar[k]&0xf, l = cigar[k]>>4;
+		if (op == BAM_CMATCH || op == BAM_CEQUAL) {
+			for (i = 0; i < l; ++i) {
+				int r = (uint8_t)ref[x+i];
+				if (r == 0) return 0; // past the end of the reference
+				r = bam_nt16_table[r];
+				if (r == 15 || bam1_seqi(seq, y+i) != r) return 0;
+			}
+			x += l; y += l;
+		} else if (op != BAM_CHARD_CLIP && op != BAM_CPAD) return 0;
+	}
+	return 1;
+}
+
 int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
 {
-	int k, i, bw, x, y, yb, ye, xb, xe, apply_baq = flag&1, extend_baq = flag>>1&1, redo_baq = flag&4;
+	return bam_prob_realn_buf(b, ref, flag, 0);
+}
+
+int bam_prob_realn_buf(bam1_t *b, const char *ref, int flag, bam_baq_buf_t *buf)
+{
+	int k, i, bw, x, y, yb, ye, xb, xe, apply_baq = flag&1, extend_baq = flag>>1&1, redo_baq = flag&4, is_tmp;
 	uint32_t *cigar = bam1_cigar(b);
 	bam1_core_t *c = &b->core;
 	kpa_par_t conf = kpa_par_def;
-	uint8_t *bq = 0, *zq = 0, *qual = bam1_qual(b);
+	uint8_t *bq = 0, *zq = 0, *qual = bam1_qual(b), *tag[2];
 	if ((c->flag & BAM_FUNMAP) || b->core.l_qseq == 0) return -1; // do nothing
-	// test if BQ or ZQ is present
-	if ((bq = bam_aux_get(b, "BQ")) != 0) ++bq;
-	if ((zq = bam_aux_get(b, "ZQ")) != 0 && *zq == 'Z') ++zq;
+	// test if BQ or ZQ is present; both in one scan of the aux block
+	bam_aux_get_n(b, 2, "BQZQ", tag);
+	if ((bq = tag[0]) != 0) ++bq;
+	if ((zq = tag[1]) != 0 && *zq == 'Z') ++zq;
 	if (bq && redo_baq)
 	{
 	    bam_aux_del(b, bq-1);
@@ -219,6 +288,16 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
 		}
 		return 0;
 	}
+	if ((is_tmp = (buf == 0)) != 0) buf = bam_baq_buf_init();
+	++buf->n_read;
+	if ((flag&8) && baq_is_exact(b, ref)) { // fast path: BAQ is taken to be the base quality
+		baq_buf_resize(buf, c->l_qseq, 0);
+		memset(buf->bq, 64, c->l_qseq); buf->bq[c->l_qseq] = 0;
+		bam_aux_append(b, apply_baq? "ZQ" : "BQ", 'Z', c->l_qseq + 1, buf->bq);
+		++buf->n_skip;
+		if (is_tmp) bam_baq_buf_destroy(buf);
+		return 0;
+	}
 	// find the start and end of the alignment	
 	x = c->pos, y = 0, yb = ye = xb = xe = -1;
 	for (k = 0; k < c->n_cigar; ++k) {
@@ -231,7 +310,10 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
 			x += l; y += l;
 		} else if (op == BAM_CSOFT_CLIP || op == BAM_CINS) y += l;
 		else if (op == BAM_CDEL) x += l;
-		else if (op == BAM_CREF_SKIP) return -1; // do nothing if there is a reference skip
+		else if (op == BAM_CREF_SKIP) { // do nothing if there is a reference skip
+			if (is_tmp) bam_baq_buf_destroy(buf);
+			return -1;
+		}
 	}
 	// set bandwidth and the start and the end
 	bw = 7;
@@ -245,18 +327,16 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
 	{ // glocal
 		uint8_t *s, *r, *q, *seq = bam1_seq(b), *bq;
 		int *state;
-		bq = calloc(c->l_qseq + 1, 1);
-		memcpy(bq, qual, c->l_qseq);
-		s = calloc(c->l_qseq, 1);
+		baq_buf_resize(buf, c->l_qseq, xe - xb);
+		bq = buf->bq; s = buf->s; r = buf->r; q = buf->q; state = buf->state;
+		memcpy(bq, qual, c->l_qseq); bq[c->l_qseq] = 0;
 		for (i = 0; i < c->l_qseq; ++i) s[i] = bam_nt16_nt4_table[bam1_seqi(seq, i)];
-		r = calloc(xe - xb, 1);
 		for (i = xb; i < xe; ++i) {
 			if (ref[i] == 0) { xe = i; break; }
 			r[i-xb] = bam_nt16_nt4_table[bam_nt16_table[(int)ref[i]]];
 		}
-		state = calloc(c->l_qseq, sizeof(int));
-		q = calloc(c->l_qseq, 1);
-		kpa_glocal(r, xe-xb, s, c->l_qseq, qual, &conf, state, q);
+		memset(state, 0, c->l_qseq * sizeof(int)); memset(q, 0, c->l_qseq); // kpa_glocal() leaves them untouched if xe<=xb
+		kpa_glocal_buf(buf->kpa, r, xe-xb, s, c->l_qseq, qual, &conf, state, q);
 		if (!extend_baq) { // in this block, bq[] is capped by base quality qual[]
 			for (k = 0, x = c->pos, y = 0; k < c->n_cigar; ++k) {
 				int op = cigar[k]&0xf, l = cigar[k]>>4;
@@ -271,8 +351,7 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
 			}
 			for (i = 0; i < c->l_qseq; ++i) bq[i] = qual[i] - bq[i] + 64; // finalize BQ
 		} else { // in this block, bq[] is BAQ that can be larger than qual[] (different from the above!)
-			uint8_t *left, *rght;
-			left = calloc(c->l_qseq, 1); rght = calloc(c->l_qseq, 1);
+			uint8_t *left = buf->left, *rght = buf->rght;
 			for (k = 0, x = c->pos, y = 0; k < c->n_cigar; ++k) {
 				int op = cigar[k]&0xf, l = cigar[k]>>4;
 				if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
@@ -289,13 +368,12 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
 				else if (op == BAM_CDEL) x += l;
 			}
 			for (i = 0; i < c->l_qseq; ++i) bq[i] = 64 + (qual[i] <= bq[i]? 0 : qual[i] - bq[i]); // finalize BQ
-			free(left); free(rght);
 		}
 		if (apply_baq) {
 			for (i = 0; i < c->l_qseq; ++i) qual[i] -= bq[i] - 64; // modify qual
 			bam_aux_append(b, "ZQ", 'Z', c->l_qseq + 1, bq);
 		} else bam_aux_append(b, "BQ", 'Z', c->l_qseq + 1, bq);
-		free(bq); free(s); free(r); free(q); free(state);
+		if (is_tmp) bam_baq_buf_destroy(buf);
 	}
 	return 0;
 }
@@ -312,6 +390,7 @@ int bam_fillmd(int argc, char *argv[])
 	faidx_t *fai;
 	char *ref = 0, mode_w[8], mode_r[8];
 	bam1_t *b;
+	bam_baq_buf_t *baq;
 
 	flt_flag = UPDATE_NM | UPDATE_MD;
 	is_bam_out = is_sam_in = is_uncompressed = is_realn = max_nm = capQ = baq_flag = 0;
@@ -361,6 +440,7 @@ int bam_fillmd(int argc, char *argv[])
 	fai = fai_load(argv[optind+1]);
 
 	b = bam_init1();
+	baq = bam_baq_buf_init();
 	while ((ret = samread(fp, b)) >= 0) {
 		if (b->core.tid >= 0) {
 			if (tid != b->core.tid) {
@@ -371,7 +451,7 @@ int bam_fillmd(int argc, char *argv[])
 					fprintf(stderr, "[bam_fillmd] fail to find sequence '%s' in the reference.\n",
 							fp->header->target_name[tid]);
 			}
-			if (is_realn) bam_prob_realn_core(b, ref, baq_flag);
+			if (is_realn) bam_prob_realn_buf(b, ref, baq_flag, baq);
 			if (capQ > 10) {
 				int q = bam_cap_mapQ(b, ref, capQ);
 				if (b->core.qual > q) b->core.qual = q;
@@ -381,6 +461,7 @@ int bam_fillmd(int argc, char *argv[])
 		samwrite(fpout, b);
 	}
 	bam_destroy1(b);
+	bam_baq_buf_destroy(baq);
 
 	free(ref);
 	fai_destroy(fai);
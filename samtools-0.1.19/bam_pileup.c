@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 #include <assert.h>
 #include "sam.h"
 
@@ -11,9 +12,11 @@ typedef struct {
 static cstate_t g_cstate_null = { -1, 0, 0, 0 };
 
 typedef struct __linkbuf_t {
-	bam1_t b;
+	bam1_t b; // must be the first member; see bam_plp_aux_get()
 	uint32_t beg, end;
 	cstate_t s;
+	int has_tag, cd;
+	uint8_t *tag[BAM_PLP_N_TAG];
 	struct __linkbuf_t *next;
 } lbnode_t;
 
@@ -154,10 +157,16 @@ struct __bam_plp_t {
 	int32_t tid, pos, max_tid, max_pos;
 	int is_eof, flag_mask, max_plp, error, maxcnt;
 	bam_pileup1_t *plp;
+	// reservoir of the reads starting at (grp_tid,grp_pos), used once the buffer is full
+	int32_t grp_tid, grp_pos;
+	int n_grp, m_grp, grp_seen;
+	lbnode_t **grp;
+	uint64_t rng;
 	// for the "auto" interface only
 	bam1_t *b;
 	bam_plp_auto_f func;
 	void *data;
+	bam_plp_cd_f cd_func;
 };
 
 bam_plp_t bam_plp_init(bam_plp_auto_f func, void *data)
@@ -170,6 +179,8 @@ bam_plp_t bam_plp_init(bam_plp_auto_f func, void *data)
 	iter->max_tid = iter->max_pos = -1;
 	iter->flag_mask = BAM_DEF_MASK;
 	iter->maxcnt = 8000;
+	iter->grp_tid = iter->grp_pos = -1;
+	iter->rng = 11; // fixed seed: the same input gives the same pileup
 	if (func) {
 		iter->func = func;
 		iter->data = data;
@@ -186,7 +197,7 @@ void bam_plp_destroy(bam_plp_t iter)
 		fprintf(stderr, "[bam_plp_destroy] memory leak: %d. Continue anyway.\n", iter->mp->cnt);
 	mp_destroy(iter->mp);
 	if (iter->b) bam_destroy1(iter->b);
-	free(iter->plp);
+	free(iter->plp); free(iter->grp);
 	free(iter);
 }
 
@@ -235,16 +246,64 @@ const bam_pileup1_t *bam_plp_next(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 	return 0;
 }
 
+static inline uint32_t plp_rand(bam_plp_t iter) // xorshift64*; private to the iterator, so thread safe
+{
+	iter->rng ^= iter->rng >> 12; iter->rng ^= iter->rng << 25; iter->rng ^= iter->rng >> 27;
+	return (uint32_t)((iter->rng * 2685821657736338717ULL) >> 32);
+}
+
+static inline void plp_set_node(bam_plp_t iter, lbnode_t *p, const bam1_t *b)
+{
+	bam_copy1(&p->b, b);
+	p->beg = b->core.pos; p->end = bam_calend(&b->core, bam1_cigar(b));
+	p->s = g_cstate_null; p->s.end = p->end - 1; // initialize cstate_t
+	p->has_tag = 0;
+	p->cd = iter->cd_func? iter->cd_func(iter->data, &p->b) : 0;
+}
+
+int bam_plp_cd(const bam_pileup1_t *p)
+{
+	return ((lbnode_t*)p->b)->cd;
+}
+
+uint8_t *bam_plp_aux_get(const bam_pileup1_t *p, int id)
+{
+	lbnode_t *q = (lbnode_t*)p->b;
+	if (!q->has_tag) { // the first lookup of this read
+		bam_aux_get_n(&q->b, BAM_PLP_N_TAG, "RGZQ", q->tag);
+		q->has_tag = 1;
+	}
+	return q->tag[id];
+}
+
+/* When the buffer holds more than maxcnt reads, reads starting at the
+ * pending column are downsampled with reservoir sampling (algorithm R)
+ * over all reads sharing that start, instead of keeping the first ones
+ * in file order. None of these reads has been piled up yet, so a slot
+ * can be overwritten in place. */
+static inline int plp_reservoir(bam_plp_t iter, const bam1_t *b)
+{
+	uint32_t j;
+	if (b->core.tid != iter->grp_tid || b->core.pos != iter->grp_pos) { // a new start position
+		iter->grp_tid = b->core.tid; iter->grp_pos = b->core.pos;
+		iter->n_grp = iter->grp_seen = 0;
+	}
+	++iter->grp_seen;
+	if (iter->tid != b->core.tid || iter->pos != b->core.pos || iter->mp->cnt <= iter->maxcnt) return 0; // not full: keep
+	if (b->core.tid != iter->max_tid || b->core.pos != iter->max_pos) return 0; // let bam_plp_push() check the order
+	j = plp_rand(iter) % iter->grp_seen;
+	if (j < iter->n_grp) plp_set_node(iter, iter->grp[j], b);
+	return 1; // taken care of here
+}
+
 int bam_plp_push(bam_plp_t iter, const bam1_t *b)
 {
 	if (iter->error) return -1;
 	if (b) {
 		if (b->core.tid < 0) return 0;
 		if (b->core.flag & iter->flag_mask) return 0;
-		if (iter->tid == b->core.tid && iter->pos == b->core.pos && iter->mp->cnt > iter->maxcnt) return 0;
-		bam_copy1(&iter->tail->b, b);
-		iter->tail->beg = b->core.pos; iter->tail->end = bam_calend(&b->core, bam1_cigar(b));
-		iter->tail->s = g_cstate_null; iter->tail->s.end = iter->tail->end - 1; // initialize cstate_t
+		if (plp_reservoir(iter, b)) return 0;
+		plp_set_node(iter, iter->tail, b);
 		if (b->core.tid < iter->max_tid) {
 			fprintf(stderr, "[bam_pileup_core] the input is not sorted (chromosomes out of order)\n");
 			iter->error = 1;
@@ -257,6 +316,11 @@ int bam_plp_push(bam_plp_t iter, const bam1_t *b)
 		}
 		iter->max_tid = b->core.tid; iter->max_pos = iter->tail->beg;
 		if (iter->tail->end > iter->pos || iter->tail->b.core.tid > iter->tid) {
+			if (iter->n_grp == iter->m_grp) {
+				iter->m_grp = iter->m_grp? iter->m_grp<<1 : 256;
+				iter->grp = (lbnode_t**)realloc(iter->grp, sizeof(lbnode_t*) * iter->m_grp);
+			}
+			iter->grp[iter->n_grp++] = iter->tail;
 			iter->tail->next = mp_alloc(iter->mp);
 			iter->tail = iter->tail->next;
 		}
@@ -292,12 +356,83 @@ const bam_pileup1_t *bam_plp_auto(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 	}
 }
 
+/*******************
+ * batched pileup *
+ *******************/
+
+bam_plp_batch_t *bam_plp_batch_init(void)
+{
+	return (bam_plp_batch_t*)calloc(1, sizeof(bam_plp_batch_t));
+}
+
+void bam_plp_batch_destroy(bam_plp_batch_t *bt)
+{
+	if (bt == 0) return;
+	free(bt->tid); free(bt->pos); free(bt->off);
+	free(bt->base); free(bt->qual); free(bt->mapq); free(bt->strand); free(bt->is_del);
+	free(bt->qpos); free(bt->indel);
+	free(bt);
+}
+
+static inline void plb_reserve_col(bam_plp_batch_t *bt, int w)
+{
+	if (w + 1 <= bt->m) return;
+	bt->m = w + 1;
+	kroundup32(bt->m);
+	bt->tid = (int32_t*)realloc(bt->tid, bt->m * 4);
+	bt->pos = (int32_t*)realloc(bt->pos, bt->m * 4);
+	bt->off = (int32_t*)realloc(bt->off, bt->m * 4);
+}
+
+static inline void plb_reserve_read(bam_plp_batch_t *bt, int n)
+{
+	if (n <= bt->m_read) return;
+	bt->m_read = n;
+	kroundup32(bt->m_read);
+	bt->base   = (uint8_t*)realloc(bt->base,   bt->m_read);
+	bt->qual   = (uint8_t*)realloc(bt->qual,   bt->m_read);
+	bt->mapq   = (uint8_t*)realloc(bt->mapq,   bt->m_read);
+	bt->strand = (uint8_t*)realloc(bt->strand, bt->m_read);
+	bt->is_del = (uint8_t*)realloc(bt->is_del, bt->m_read);
+	bt->qpos   = (int32_t*)realloc(bt->qpos,   bt->m_read * 4);
+	bt->indel  = (int32_t*)realloc(bt->indel,  bt->m_read * 4);
+}
+
+int bam_plp_auto_batch(bam_plp_t iter, int w, bam_plp_batch_t *bt)
+{
+	const bam_pileup1_t *plp;
+	int tid, pos, n_plp = 0, k = 0;
+	plb_reserve_col(bt, w);
+	bt->n = 0; bt->off[0] = 0;
+	while (bt->n < w && (plp = bam_plp_auto(iter, &tid, &pos, &n_plp)) != 0) {
+		int i;
+		plb_reserve_read(bt, k + n_plp);
+		for (i = 0; i < n_plp; ++i, ++k) { // flatten the column; the alignments are not needed after this
+			const bam_pileup1_t *p = plp + i;
+			const bam1_t *b = p->b;
+			if (p->is_del) bt->base[k] = bt->qual[k] = 0;
+			else bt->base[k] = bam1_seqi(bam1_seq(b), p->qpos), bt->qual[k] = bam1_qual(b)[p->qpos];
+			bt->mapq[k] = b->core.qual;
+			bt->strand[k] = bam1_strand(b);
+			bt->is_del[k] = p->is_del;
+			bt->qpos[k] = p->qpos;
+			bt->indel[k] = p->indel;
+		}
+		bt->tid[bt->n] = tid; bt->pos[bt->n] = pos;
+		bt->off[++bt->n] = k;
+	}
+	if (bt->n == 0 && n_plp < 0) return -1;
+	return bt->n;
+}
+
 void bam_plp_reset(bam_plp_t iter)
 {
 	lbnode_t *p, *q;
 	iter->max_tid = iter->max_pos = -1;
 	iter->tid = iter->pos = 0;
 	iter->is_eof = 0;
+	iter->grp_tid = iter->grp_pos = -1;
+	iter->n_grp = iter->grp_seen = 0;
 	for (p = iter->head; p->next;) {
 		q = p->next;
 		mp_free(iter->mp, p);
@@ -316,6 +451,11 @@ void bam_plp_set_maxcnt(bam_plp_t iter, int maxcnt)
 	iter->maxcnt = maxcnt;
 }
 
+void bam_plp_constructor(bam_plp_t iter, bam_plp_cd_f func)
+{
+	iter->cd_func = func;
+}
+
 /*****************
  * callback APIs *
  *****************/
@@ -383,15 +523,49 @@ struct __bam_mplp_t {
 	bam_plp_t *iter;
 	int *n_plp;
 	const bam_pileup1_t **plp;
+	// min-heap of files with a pending column, keyed by (pos[i],i)
+	int n_heap, *heap;
+	// files at the current column, in ascending order; they are advanced in the next call
+	int n_idx, *idx;
 };
 
+#define mplp_lt(iter, a, b) ((iter)->pos[a] < (iter)->pos[b] || ((iter)->pos[a] == (iter)->pos[b] && (a) < (b)))
+
+static inline void mplp_heap_push(bam_mplp_t iter, int i)
+{
+	int k = iter->n_heap++, *h = iter->heap;
+	while (k > 0) {
+		int p = (k - 1) >> 1;
+		if (!mplp_lt(iter, i, h[p])) break;
+		h[k] = h[p]; k = p;
+	}
+	h[k] = i;
+}
+
+static inline int mplp_heap_pop(bam_mplp_t iter)
+{
+	int *h = iter->heap, top = h[0], last = h[--iter->n_heap], k = 0, n = iter->n_heap;
+	for (;;) {
+		int c = (k << 1) + 1;
+		if (c >= n) break;
+		if (c + 1 < n && mplp_lt(iter, h[c+1], h[c])) ++c;
+		if (!mplp_lt(iter, h[c], last)) break;
+		h[k] = h[c]; k = c;
+	}
+	if (n) h[k] = last;
+	return top;
+}
+
 void bam_mplp_partinit (bam_mplp_t iter) {
 	int i;
 	iter->min = (uint64_t)-1;
+	iter->n_heap = 0;
 	for (i = 0; i < iter->n; ++i) {
 			iter->pos[i] = iter->min;
 			iter->iter[i]->is_eof = 0;
+			iter->idx[i] = i;
 	}
+	iter->n_idx = iter->n;
 }
 
 bam_mplp_t bam_mplp_init(int n, bam_plp_auto_f func, void **data)
@@ -403,12 +577,16 @@ bam_mplp_t bam_mplp_init(int n, bam_plp_auto_f func, void **data)
 	iter->n_plp = calloc(n, sizeof(int));
 	iter->plp = calloc(n, sizeof(void*));
 	iter->iter = calloc(n, sizeof(void*));
+	iter->heap = calloc(n, sizeof(int));
+	iter->idx = calloc(n, sizeof(int));
 	iter->n = n;
 	iter->min = (uint64_t)-1;
 	for (i = 0; i < n; ++i) {
 		iter->iter[i] = bam_plp_init(func, data[i]);
 		iter->pos[i] = iter->min;
+		iter->idx[i] = i; // all files have to be read at the first call
 	}
+	iter->n_idx = n;
 	return iter;
 }
 
@@ -419,43 +597,71 @@ void bam_mplp_set_maxcnt(bam_mplp_t iter, int maxcnt)
 		iter->iter[i]->maxcnt = maxcnt;
 }
 
+void bam_mplp_constructor(bam_mplp_t iter, bam_plp_cd_f func)
+{
+	int i;
+	for (i = 0; i < iter->n; ++i)
+		iter->iter[i]->cd_func = func;
+}
+
 void bam_mplp_destroy(bam_mplp_t iter)
 {
 	int i;
 	for (i = 0; i < iter->n; ++i) bam_plp_destroy(iter->iter[i]);
 	free(iter->iter); free(iter->pos); free(iter->n_plp); free(iter->plp);
+	free(iter->heap); free(iter->idx);
 	free(iter);
 }
 
-int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp)
+static int mplp_advance(bam_mplp_t iter)
 {
-//    fprintf (stderr,"!");
-//    fflush(stderr);
-//    fprintf(stderr, "[bam_mplp_auto] iter %#x, pos %d\n", (uint64_t)iter, iter->pos);
-	int i, ret = 0;
-	uint64_t new_min = (uint64_t)-1;
-	for (i = 0; i < iter->n; ++i) {
-//        fprintf (stderr,"\npos[i]=%d, min=%d\n",iter->pos[i], iter->min);
-		if (iter->pos[i] == iter->min) {
-			int tid, pos;
-			iter->plp[i] = bam_plp_auto(iter->iter[i], &tid, &pos, &iter->n_plp[i]);
-			iter->pos[i] = (uint64_t)tid<<32 | pos;
-//            fprintf (stderr,"plp=%#x, tid=%d, pos=%u\n", iter->plp[i], tid, iter->pos[i]);
+	int i, k;
+	// only the files that contributed to the last column have moved on
+	for (k = 0; k < iter->n_idx; ++k) {
+		int tid, pos;
+		i = iter->idx[k];
+		iter->plp[i] = bam_plp_auto(iter->iter[i], &tid, &pos, &iter->n_plp[i]);
+		if (iter->plp[i] == 0) { // end of file or error; not put back to the heap
+			iter->pos[i] = (uint64_t)-1;
+			continue;
 		}
-		if (iter->plp[i] && iter->pos[i] < new_min) new_min = iter->pos[i];
-//        fprintf (stderr,"pos[i]=%d, new_min=%d\n",iter->pos[i], new_min);
-//        fprintf (stderr,"!, %u\n", (uint64_t)-1);
+		iter->pos[i] = (uint64_t)tid<<32 | pos;
+		mplp_heap_push(iter, i);
 	}
-    iter->min = new_min;
-    if (new_min == (uint64_t)-1) return 0;
-	*_tid = new_min>>32; *_pos = (uint32_t)new_min;
-	for (i = 0; i < iter->n; ++i) {
-		if (iter->pos[i] == iter->min) { // FIXME: valgrind reports "uninitialised value(s) at this line"
-			n_plp[i] = iter->n_plp[i], plp[i] = iter->plp[i];
-			++ret;
-		} else n_plp[i] = 0, plp[i] = 0;
+	iter->n_idx = 0;
+	if (iter->n_heap == 0) {
+		iter->min = (uint64_t)-1;
+		return 0;
+	}
+	iter->min = iter->pos[iter->heap[0]];
+	while (iter->n_heap && iter->pos[iter->heap[0]] == iter->min) // popped in ascending file order
+		iter->idx[iter->n_idx++] = mplp_heap_pop(iter);
+	return iter->n_idx;
+}
+
+int bam_mplp_auto_sparse(bam_mplp_t iter, int *_tid, int *_pos, const int **idx, int *n_plp, const bam_pileup1_t **plp)
+{
+	int k, ret;
+	if ((ret = mplp_advance(iter)) == 0) return 0;
+	*_tid = iter->min>>32; *_pos = (uint32_t)iter->min;
+	for (k = 0; k < ret; ++k) {
+		int i = iter->idx[k];
+		n_plp[k] = iter->n_plp[i], plp[k] = iter->plp[i];
+	}
+	*idx = iter->idx;
+	return ret;
+}
+
+int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp)
+{
+	int k, ret;
+	if ((ret = mplp_advance(iter)) == 0) return 0;
+	*_tid = iter->min>>32; *_pos = (uint32_t)iter->min;
+	memset(n_plp, 0, iter->n * sizeof(int));
+	memset(plp, 0, iter->n * sizeof(void*));
+	for (k = 0; k < ret; ++k) {
+		int i = iter->idx[k];
+		n_plp[i] = iter->n_plp[i], plp[i] = iter->plp[i];
 	}
-//    fprintf(stderr, "[bam_mplp_auto] end iter %#x, pos %d\n", (uint64_t)iter, iter->pos[0]);
-//    fflush(stderr);
-    return ret;
+	return ret;
 }
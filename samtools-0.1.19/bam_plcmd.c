@@ -145,7 +145,11 @@ static inline void kpileup_seq(const bam_pileup1_t *p, int pos, int ref_len, con
 
 #include <assert.h>
 #include "bam2bcf.h"
+#include "bcftools/prob1.h"
 #include "sample.h"
+#include "kprobaln.h"
+#include "baqcache.h"
+#include "kthread.h"
 
 #define MPLP_GLF   0x10
 #define MPLP_NO_COMP 0x20
@@ -158,13 +162,18 @@ static inline void kpileup_seq(const bam_pileup1_t *p, int pos, int ref_len, con
 #define MPLP_PRINT_POS 0x4000
 #define MPLP_PRINT_MAPQ 0x8000
 #define MPLP_PER_SAMPLE 0x10000
+#define MPLP_BAQ_SKIP 0x20000
+#define MPLP_BAQ_FP32 0x40000
+#define MPLP_BAQ_CACHE 0x80000
+#define MPLP_GVCF 0x100000
+#define MPLP_CALL 0x200000
 
 void *bed_read(const char *fn);
 void bed_destroy(void *_h);
 int bed_overlap(const void *_h, const char *chr, int beg, int end);
 
 typedef struct {
-	int max_mq, min_mq, flag, min_baseQ, capQ_thres, max_depth, max_indel_depth, fmt_flag, num_threads;
+	int max_mq, min_mq, flag, min_baseQ, capQ_thres, max_depth, max_indel_depth, fmt_flag, num_threads, baq_threads, indel_threads, seed;
     int rflag_require, rflag_filter;
 	int openQ, extQ, tandemQ, min_support; // for indels
 	double min_frac; // for indels
@@ -183,8 +192,28 @@ typedef struct {
 	char *ref;
     const mplp_conf_t *conf;
     const void * bed;
+    int file; // index of the input file, for bam_smpl_file2smid()
+    const bam_sample_t *sm;
+    bam_baq_buf_t *baq; // BAQ workspace, shared by the files of one thread
+    baqc_t *bqc; // BAQ sidecar of this file, shared by all threads
+    baqc_local_t *bql; // and its per-thread state
+    struct __mplp_batch_t *bt; // reads read ahead for batched BAQ; NULL if not batching
 } mplp_aux_t;
 
+#define MPLP_BATCH 1024
+
+// a batch of reads that passed the filters, handed out in order by mplp_func()
+typedef struct __mplp_batch_t {
+	int n, i, eof; // eof: return value of the read that ended the input
+	int n_realn, *realn; // indices of the reads that need the HMM
+	uint8_t *st; // per read: 0 no BAQ, 1 BAQ, 2 BAQ and keep it in the sidecar
+	uint64_t *voff;
+	bam1_t **b;
+	kt_pool_t *pool; // shared by the files of one thread
+	bam_baq_buf_t **baq; // one BAQ workspace per pool thread
+	mplp_aux_t *ma;
+} mplp_batch_t;
+
 typedef struct {
     int n; int *n_plp, *m_plp;
 	bam_pileup1_t **plp;
@@ -205,29 +234,66 @@ typedef struct {
     const bam_sample_t *sm;
     bcf_t *bp;		//BCF file struct, bp->fp - file pointer, can be stdout
     const bcf_hdr_t *bh;	//BCF header. We use bp->fp and bh->n_smpl in bcf_write()
+    int max_depth;		//per-file depth cap; deeper columns are downsampled
     int max_indel_depth;
     const void *rghash;
+    long *baq_stat;		//out: reads given BAQ and those that skipped the HMM
+    long *indel_stat;	//out: reads realigned at indel sites and those scored from the per-site cache
+    bcf_pool_t *pool;	//records of this thread, recycled by the writer
+    baqc_md5_t *md5;	//reference MD5s for the BAQ sidecars, shared by all threads
 } mplp_kernel_args_t;
 
-static int mplp_func(void *data, bam1_t *b)
+// filters that only need the core; rejected reads are skipped without loading their data
+static int mplp_core_filter(void *data, const bam1_core_t *c)
 {
-	extern int bam_realn(bam1_t *b, const char *ref);
-	extern int bam_prob_realn_core(bam1_t *b, const char *ref, int);
-    extern int bam_cap_mapQ(bam1_t *b, char *ref, int thres);
 	mplp_aux_t *ma = (mplp_aux_t*)data;
+	int has_ref;
+	if (c->tid < 0 || (c->flag&BAM_FUNMAP)) return 1; // exclude unmapped reads
+	if (ma->conf->rflag_require && !(ma->conf->rflag_require&c->flag)) return 1;
+	if (ma->conf->rflag_filter && ma->conf->rflag_filter&c->flag) return 1;
+	has_ref = (ma->ref && ma->ref_id == c->tid)? 1 : 0;
+	if (has_ref && (ma->ref_len <= c->pos)) { // exclude reads outside of the reference sequence
+	  fprintf(stderr,"[%s] Skipping because %d is outside of %d [ref:%d]\n",__func__,c->pos,ma->ref_len,ma->ref_id);
+	  return 1;
+	}
+	if (has_ref && ma->conf->capQ_thres > 10) return 0; // mapQ is adjusted later
+	if (c->qual < ma->conf->min_mq) return 1;
+	if ((ma->conf->flag&MPLP_NO_ORPHAN) && (c->flag&1) && !(c->flag&2)) return 1;
+	return 0;
+}
+
+static inline int mplp_baq_flag(const mplp_conf_t *conf)
+{
+	return ((conf->flag & MPLP_REDO_BAQ)? 7 : 3) | ((conf->flag & MPLP_BAQ_SKIP)? 8 : 0);
+}
+
+static void mplp_realn(mplp_aux_t *ma, bam1_t *b)
+{
+	uint8_t *tag[2];
+	uint64_t voff;
+	if (ma->bql == 0) {
+		bam_prob_realn_buf(b, ma->ref, mplp_baq_flag(ma->conf), ma->baq);
+		return;
+	}
+	bam_aux_get_n(b, 2, "BQZQ", tag);
+	if (tag[0] || tag[1]) { // existing BQ/ZQ are handled by bam_prob_realn_buf() as usual
+		bam_prob_realn_buf(b, ma->ref, mplp_baq_flag(ma->conf), ma->baq);
+		return;
+	}
+	voff = bam_tell(ma->fp); // just past b
+	if (baqc_apply(ma->bql, voff, b)) return;
+	if (bam_prob_realn_buf(b, ma->ref, mplp_baq_flag(ma->conf), ma->baq) == 0)
+		baqc_push(ma->bql, voff, b);
+}
+
+// next read passing the filters that BAQ does not affect; *has_ref tells if ma->ref covers it
+static int mplp_read1(mplp_aux_t *ma, bam1_t *b, int *has_ref)
+{
 	int ret, skip = 0;
 	do {
-		int has_ref;
-        ret = ma->iter? bam_iter_read(ma->fp, ma->iter, b) : bam_read1(ma->fp, b);
+        ret = ma->iter? bam_iter_read_filter(ma->fp, ma->iter, b, mplp_core_filter, ma) : bam_read1_filter(ma->fp, b, mplp_core_filter, ma);
 //        fprintf(stderr, "[mplp_func]ret=%i\n", ret);
-		if (ret < 0) break;
-		if (b->core.tid < 0 || (b->core.flag&BAM_FUNMAP)) { // exclude unmapped reads
-			skip = 1;
-//           fprintf (stderr,"[mplp_func] exclude unmapped reads\n");
-			continue;
-		}
-        if (ma->conf->rflag_require && !(ma->conf->rflag_require&b->core.flag)) { skip = 1; continue; }
-        if (ma->conf->rflag_filter && ma->conf->rflag_filter&b->core.flag) { skip = 1; continue; }
+		if (ret < 0) return ret;
         if (ma->bed) { // test overlap
             skip = !bed_overlap(ma->bed, ma->h->target_name[b->core.tid], b->core.pos, bam_calend(&b->core, bam1_cigar(b)));
 //            fprintf (stderr,"[mplp_func] bed_overlap chr=%s, pos=%d, end=%d, skip=%d\n", ma->h->target_name[b->core.tid], b->core.pos,bam_calend(&b->core, bam1_cigar(b)),skip);
@@ -238,56 +304,169 @@ static int mplp_func(void *data, bam1_t *b)
 			skip = (rg && bcf_str2id(ma->conf->rghash, (const char*)(rg+1)) >= 0);
 			if (skip) continue;
 		}
-		if (ma->conf->flag & MPLP_ILLUMINA13) {
-			int i;
-			uint8_t *qual = bam1_qual(b);
-			for (i = 0; i < b->core.l_qseq; ++i)
-				qual[i] = qual[i] > 31? qual[i] - 31 : 0;
+	} while (skip);
+	if (ma->conf->flag & MPLP_ILLUMINA13) {
+		int i;
+		uint8_t *qual = bam1_qual(b);
+		for (i = 0; i < b->core.l_qseq; ++i)
+			qual[i] = qual[i] > 31? qual[i] - 31 : 0;
+	}
+	*has_ref = (ma->ref && ma->ref_id == b->core.tid)? 1 : 0;
+	return ret;
+}
+
+// cap the mapping quality of a read covered by ma->ref; 1 if the read is to be dropped
+static int mplp_capQ(mplp_aux_t *ma, bam1_t *b)
+{
+    extern int bam_cap_mapQ(bam1_t *b, char *ref, int thres);
+	int q;
+	if (ma->conf->capQ_thres <= 10) return 0;
+	q = bam_cap_mapQ(b, ma->ref, ma->conf->capQ_thres);
+	if (q < 0) return 1;
+	if (b->core.qual > q) b->core.qual = q;
+	return 0;
+}
+
+#define MPLP_ST_REF  1 // covered by ma->ref
+#define MPLP_ST_HMM  2 // BAQ to be computed
+#define MPLP_ST_PUSH 4 // and kept in the sidecar
+
+static mplp_batch_t *mplp_batch_init(mplp_aux_t *ma, kt_pool_t *pool, bam_baq_buf_t **baq)
+{
+	mplp_batch_t *bt;
+	int i;
+	bt = calloc(1, sizeof(mplp_batch_t));
+	bt->ma = ma, bt->pool = pool, bt->baq = baq;
+	bt->realn = calloc(MPLP_BATCH, sizeof(int));
+	bt->st = calloc(MPLP_BATCH, 1);
+	bt->voff = calloc(MPLP_BATCH, 8);
+	bt->b = calloc(MPLP_BATCH, sizeof(void*));
+	for (i = 0; i < MPLP_BATCH; ++i) bt->b[i] = bam_init1();
+	return bt;
+}
+
+static void mplp_batch_destroy(mplp_batch_t *bt)
+{
+	int i;
+	if (bt == 0) return;
+	for (i = 0; i < MPLP_BATCH; ++i) bam_destroy1(bt->b[i]);
+	free(bt->b); free(bt->voff); free(bt->st); free(bt->realn); free(bt);
+}
+
+static void mplp_batch_realn(void *data, long k, int tid)
+{
+	mplp_batch_t *bt = (mplp_batch_t*)data;
+	int i = bt->realn[k];
+	if (bam_prob_realn_buf(bt->b[i], bt->ma->ref, mplp_baq_flag(bt->ma->conf), bt->baq[tid]) != 0)
+		bt->st[i] &= ~MPLP_ST_PUSH;
+}
+
+/* Read ahead up to MPLP_BATCH reads and compute their BAQ on the pool. The
+   reference is only switched once the pileup has seen a read past it, so a
+   batch ends at the first read that ma->ref does not cover: every read gets
+   the reference it would get if read one at a time. */
+static void mplp_batch_fill(mplp_aux_t *ma)
+{
+	mplp_batch_t *bt = ma->bt;
+	int i, n, ret, has_ref, realn = ma->conf->flag & MPLP_REALN;
+	bt->n = bt->i = bt->n_realn = 0;
+	while (bt->n < MPLP_BATCH) {
+		bam1_t *b = bt->b[bt->n];
+		if ((ret = mplp_read1(ma, b, &has_ref)) < 0) {
+			bt->eof = ret;
+			break;
 		}
-		has_ref = (ma->ref && ma->ref_id == b->core.tid)? 1 : 0;
-		if (has_ref && (ma->ref_len <= b->core.pos)) { // exclude reads outside of the reference sequence
-		  fprintf(stderr,"[%s] Skipping because %d is outside of %d [ref:%d]\n",__func__,b->core.pos,ma->ref_len,ma->ref_id);
-		  skip = 1;
-		  continue;
+		bt->st[bt->n] = has_ref? MPLP_ST_REF : 0;
+		if (!has_ref) {
+			++bt->n;
+			break;
 		}
-		skip = 0;
-		if (has_ref && (ma->conf->flag&MPLP_REALN)) bam_prob_realn_core(b, ma->ref, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3);
-		if (has_ref && ma->conf->capQ_thres > 10) {
-			int q = bam_cap_mapQ(b, ma->ref, ma->conf->capQ_thres);
-			if (q < 0) skip = 1;
-			else if (b->core.qual > q) b->core.qual = q;
+		if (realn) {
+			uint8_t *tag[2];
+			int st = MPLP_ST_HMM;
+			if (ma->bql) {
+				bam_aux_get_n(b, 2, "BQZQ", tag);
+				if (tag[0] == 0 && tag[1] == 0) {
+					bt->voff[bt->n] = bam_tell(ma->fp); // just past b
+					st = baqc_apply(ma->bql, bt->voff[bt->n], b)? 0 : MPLP_ST_HMM|MPLP_ST_PUSH;
+				}
+			}
+			if (st) bt->realn[bt->n_realn++] = bt->n;
+			bt->st[bt->n] |= st;
+		}
+		++bt->n;
+	}
+	kt_pool_for(bt->pool, mplp_batch_realn, bt, bt->n_realn);
+	for (i = n = 0; i < bt->n; ++i) {
+		bam1_t *b = bt->b[i];
+		if (bt->st[i] & MPLP_ST_PUSH) baqc_push(ma->bql, bt->voff[i], b);
+		if ((bt->st[i] & MPLP_ST_REF) && mplp_capQ(ma, b)) continue;
+		bt->b[i] = bt->b[n], bt->b[n++] = b; // keep the order
+	}
+	bt->n = n;
+}
+
+static int mplp_func(void *data, bam1_t *b)
+{
+	mplp_aux_t *ma = (mplp_aux_t*)data;
+	int ret, has_ref, skip;
+	if (ma->bt) {
+		mplp_batch_t *bt = ma->bt;
+		bam1_t tmp;
+		while (bt->i == bt->n) {
+			if (bt->eof < 0) return bt->eof;
+			mplp_batch_fill(ma);
 		}
-		else if (b->core.qual < ma->conf->min_mq) skip = 1; 
-		else if ((ma->conf->flag&MPLP_NO_ORPHAN) && (b->core.flag&1) && !(b->core.flag&2)) skip = 1;
+		tmp = *b, *b = *bt->b[bt->i], *bt->b[bt->i++] = tmp; // hand over the data without copying
+		return b->data_len;
+	}
+	do {
+		if ((ret = mplp_read1(ma, b, &has_ref)) < 0) break;
+		skip = 0;
+		if (has_ref && (ma->conf->flag&MPLP_REALN)) mplp_realn(ma, b);
+		if (has_ref) skip = mplp_capQ(ma, b);
 	} while (skip);
 	return ret;
 }
 
-static void group_smpl(mplp_pileup_t *m, const bam_sample_t *sm, kstring_t *buf,
-                       int n, const char **fn, int *n_plp, const bam_pileup1_t **plp, int ignore_rg)
+// sample id of a read, computed once as it enters the pileup buffer
+static int mplp_smpl_cd(void *data, const bam1_t *b)
+{
+	mplp_aux_t *ma = (mplp_aux_t*)data;
+	uint8_t *rg = (ma->conf->flag & MPLP_IGNORE_RG)? 0 : bam_aux_get(b, "RG");
+	return bam_smpl_file2smid(ma->sm, ma->file, rg? (char*)rg+1 : 0);
+}
+
+// n_plp[i] and plp[i] are the pileup of file idx[i] as returned by bam_mplp_auto_sparse()
+static void group_smpl(mplp_pileup_t *m, int n, const int *idx, const char **fn, int *n_plp, const bam_pileup1_t **plp)
 {
 	int i, j;
 	memset(m->n_plp, 0, m->n * sizeof(int));
-	for (i = 0; i < n; ++i) {
+	for (i = 0; i < n; ++i) { // count the reads of each sample
 		for (j = 0; j < n_plp[i]; ++j) {
-			const bam_pileup1_t *p = plp[i] + j;
-			uint8_t *q;
-			int id = -1;
-			q = ignore_rg? 0 : bam_aux_get(p->b, "RG");
-			if (q) id = bam_smpl_rg2smid(sm, fn[i], (char*)q+1, buf);
-			if (id < 0) id = bam_smpl_rg2smid(sm, fn[i], 0, buf);
+			int id = bam_plp_cd(plp[i] + j);
 			if (id < 0 || id >= m->n) {
+				uint8_t *q = bam_plp_aux_get(plp[i] + j, BAM_PLP_RG);
 				assert(q); // otherwise a bug
-				fprintf(stderr, "[%s] Read group %s used in file %s but absent from the header or an alignment missing read group.\n", __func__, (char*)q+1, fn[i]);
+				fprintf(stderr, "[%s] Read group %s used in file %s but absent from the header or an alignment missing read group.\n", __func__, (char*)q+1, fn[idx[i]]);
 				exit(1);
 			}
-			if (m->n_plp[id] == m->m_plp[id]) {
-				m->m_plp[id] = m->m_plp[id]? m->m_plp[id]<<1 : 8;
-				m->plp[id] = realloc(m->plp[id], sizeof(bam_pileup1_t) * m->m_plp[id]);
-			}
-			m->plp[id][m->n_plp[id]++] = *p;
+			++m->n_plp[id];
+		}
+	}
+	for (i = 0; i < m->n; ++i) {
+		if (m->n_plp[i] > m->m_plp[i]) {
+			m->m_plp[i] = m->n_plp[i];
+			kroundup32(m->m_plp[i]);
+			m->plp[i] = realloc(m->plp[i], sizeof(bam_pileup1_t) * m->m_plp[i]);
 		}
+		m->n_plp[i] = 0;
 	}
+	for (i = 0; i < n; ++i) // scatter
+		for (j = 0; j < n_plp[i]; ++j) {
+			int id = bam_plp_cd(plp[i] + j);
+			m->plp[id][m->n_plp[id]++] = plp[i][j];
+		}
 }
 
 int bam_reopen(bamFile * fp, const char* fn) {
@@ -304,17 +483,154 @@ int bam_reopen(bamFile * fp, const char* fn) {
     return 0;
 }
 
+/* A reference block: consecutive sites whose only ALT is X. It is
+   written as the record of its first site, with END and MinDP prepended
+   to the INFO of the site with the lowest depth, QUAL the lowest of the
+   block, and for each sample the smallest value of every FORMAT field
+   over the block. GQ is added from the smaller of the non-reference PLs,
+   and with --call GT is 0/0. */
+typedef struct {
+    bcf1_t *b; // first site; NULL if there is no open block
+    int end, min_dp, is_call;
+    float min_qual;
+    kstring_t info, tmp;
+} mplp_block_t;
+
+// make s, laid out as b->str, the string of b
+static void mplp_block_set_str(bcf1_t *b, kstring_t *s)
+{
+    char *swap;
+    swap = b->str; b->str = s->s; s->s = swap;
+    b->l_str = s->l; s->l = 0;
+    s->m ^= b->m_str; b->m_str ^= s->m; s->m ^= b->m_str;
+    bcf_sync(b);
+}
+
+// turn a site the caller found non-variant into a reference site: ALT becomes X, and each sample keeps
+// the PL of RR and the smallest PLs of the genotypes with one and with two non-reference alleles
+static void mplp_block_ref(mplp_block_t *blk, bcf1_t *b)
+{
+    kstring_t *s = &blk->tmp;
+    int i, j, k, l, n = b->n_alleles, x = n * (n + 1) / 2;
+    for (i = 0; i < b->n_gi; ++i) {
+        if (b->gi[i].fmt == bcf_str2int("PL", 2)) {
+            uint8_t *d = b->gi[i].data;
+            for (l = 0; l < b->n_smpl; ++l) {
+                uint8_t *dl = d + l * x;
+                int rx = 255, xx = 255;
+                for (k = 1; k < n; ++k) {
+                    if (dl[k*(k+1)/2] < rx) rx = dl[k*(k+1)/2];
+                    for (j = 1; j <= k; ++j)
+                        if (dl[k*(k+1)/2+j] < xx) xx = dl[k*(k+1)/2+j];
+                }
+                d[l*3] = dl[0], d[l*3+1] = rx, d[l*3+2] = xx; // l*3 <= l*x: dl is read before being overwritten
+            }
+        }
+    }
+    s->l = 0;
+    kputc('\0', s);
+    kputs(b->ref, s); kputc('\0', s);
+    kputs("X", s); kputc('\0', s);
+    kputs(b->flt, s); kputc('\0', s);
+    kputs(b->info, s); kputc('\0', s);
+    kputs(b->fmt, s); kputc('\0', s);
+    mplp_block_set_str(b, s);
+}
+
+static void mplp_block_flush(mplp_block_t *blk, bcf_t *bp, const bcf_hdr_t *bh)
+{
+    bcf1_t *b = blk->b;
+    kstring_t *s = &blk->tmp;
+    int i, k, n_gi;
+    if (b == 0) return;
+    s->l = 0;
+    kputc('\0', s);
+    kputs(b->ref, s); kputc('\0', s);
+    kputs(b->alt, s); kputc('\0', s);
+    kputs(b->flt, s); kputc('\0', s);
+    if (blk->end > b->pos) {
+        kputs("END=", s); kputw(blk->end + 1, s);
+        kputs(";MinDP=", s); kputw(blk->min_dp, s); kputc(';', s);
+    }
+    kputs(blk->info.s, s); kputc('\0', s);
+    kputs(b->fmt, s); kputs(blk->is_call? ":GQ:GT" : ":GQ", s); kputc('\0', s);
+    n_gi = b->n_gi;
+    mplp_block_set_str(b, s);
+    b->qual = blk->min_qual;
+    for (i = 0; i < n_gi; ++i) {
+        if (b->gi[i].fmt == bcf_str2int("PL", 2)) {
+            uint8_t *pl = b->gi[i].data, *gq = b->gi[n_gi].data;
+            for (k = 0; k < b->n_smpl; ++k, pl += 3)
+                gq[k] = pl[1] < pl[2]? pl[1] : pl[2];
+        }
+    }
+    if (blk->is_call) {
+        memset(b->gi[n_gi+1].data, 0, b->n_smpl); // 0/0
+        bcf_fix_gt(b);
+    }
+    bcf_write_queue(bp, bh, b);
+    blk->b = 0;
+}
+
+static inline int mplp_is_ref(const bcf1_t *b)
+{
+    return (b->n_alleles == 2 && strcmp(b->alt, "X") == 0);
+}
+
+// add site b of depth dp to the block, or flush the block and return 0 if b is not a reference site following it
+static int mplp_block_push(mplp_block_t *blk, bcf1_t *b, int dp, bcf_t *bp, const bcf_hdr_t *bh)
+{
+    int i, j, is_ref = mplp_is_ref(b);
+    if (blk->b && (!is_ref || b->tid != blk->b->tid || b->pos != blk->end + 1))
+        mplp_block_flush(blk, bp, bh);
+    if (!is_ref) return 0;
+    if (blk->b == 0) {
+        blk->b = b, blk->end = b->pos, blk->min_dp = dp + 1, blk->min_qual = b->qual;
+    } else {
+        if (b->qual < blk->min_qual) blk->min_qual = b->qual;
+        for (i = 0; i < b->n_gi; ++i) {
+            bcf_ginfo_t *g = &blk->b->gi[i], *h = &b->gi[i];
+            int n = g->len * b->n_smpl;
+            if (g->fmt == bcf_str2int("PL", 2) || g->len == 1) {
+                uint8_t *x = g->data, *y = h->data;
+                for (j = 0; j < n; ++j) if (y[j] < x[j]) x[j] = y[j];
+            } else if (g->len == 2) {
+                uint16_t *x = g->data, *y = h->data;
+                for (j = 0; j < n / 2; ++j) if (y[j] < x[j]) x[j] = y[j];
+            } else if (g->len == 4) {
+                int32_t *x = g->data, *y = h->data;
+                for (j = 0; j < n / 4; ++j) if (y[j] < x[j]) x[j] = y[j];
+            }
+        }
+        blk->end = b->pos;
+    }
+    if (dp < blk->min_dp) {
+        blk->min_dp = dp;
+        blk->info.l = 0;
+        kputs(b->info, &blk->info);
+    }
+    if (b != blk->b) bcf_pool_put(b);
+    return 1;
+}
+
 void * mpileup_kern (
         void * args) {
-	int i, pos /*, *tid*/;
+	int i, pos, n_idx /*, *tid*/;
 	int* n_plp;
+	const int *idx;
+	const uint8_t *md5;
 	const bam_pileup1_t **plp;
 	bcf_callret1_t *bcr = 0;
 	mplp_pileup_t gplp;
-	kstring_t buf;		//Filled deeper in group_smpl
     bcf_call_t bc;
     bam_mplp_t iter;
     bcf_callaux_t *bca = NULL;
+    mplp_block_t blk;
+    bcf_p1aux_t *p1 = 0;
+    bcf_em_t *em = 0;
+    bam_baq_buf_t **baq;
+    kt_pool_t *pool = 0, *indel_pool = 0;
+    int n_baq = 1;
     mplp_kernel_args_t *params = (mplp_kernel_args_t *)args;
     const mplp_conf_t *conf = params->conf;	//Config. const
     mplp_aux_t **data = params->data;
@@ -342,6 +658,18 @@ void * mpileup_kern (
     n_plp = calloc(n, sizeof(int));
     plp = calloc(n, sizeof(void*));
     bcr = calloc(sm->n, sizeof(bcf_callret1_t));
+    if (conf->baq_threads > 1 && (conf->flag & MPLP_REALN)) {
+        n_baq = conf->baq_threads;
+        pool = kt_pool_init(n_baq);
+    }
+    baq = calloc(n_baq, sizeof(void*));
+    for (i = 0; i < n_baq; ++i) baq[i] = bam_baq_buf_init();
+    for (i = 0; i < n; ++i) {
+        data[i]->baq = baq[0];
+        data[i]->bt = pool? mplp_batch_init(data[i], pool, baq) : 0;
+        data[i]->bql = data[i]->bqc? baqc_local_init(data[i]->bqc) : 0;
+        if (data[i]->bql && ref_tid >= 0) baqc_set_ref(data[i]->bql, ref_tid, baqc_md5_get(params->md5, ref_tid, ref, ref_len));
+    }
 
     if (conf->flag & MPLP_GLF) {
         bca = bcf_call_init(-1., conf->min_baseQ);
@@ -350,20 +678,30 @@ void * mpileup_kern (
         bca->min_frac = conf->min_frac;
         bca->min_support = conf->min_support;
         bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
+        bca->seed = conf->seed;
+        if (conf->indel_threads > 1 && !(conf->flag & MPLP_NO_INDEL))
+            bca->pool = indel_pool = kt_pool_init(conf->indel_threads);
+        if (conf->flag & MPLP_CALL) { // the default model of bcftools view
+            p1 = bcf_p1_init(params->sm->n, 0);
+            bcf_p1_init_prior(p1, MC_PTYPE_FULL, 1e-3);
+            em = bcf_em_init();
+        }
     }
 
 	memset(&gplp, 0, sizeof(mplp_pileup_t));
+	memset(&blk, 0, sizeof(mplp_block_t));
+	blk.is_call = (p1 != 0);
     gplp.n = sm->n;
     gplp.n_plp = calloc(sm->n, sizeof(int));
     gplp.m_plp = calloc(sm->n, sizeof(int));
     gplp.plp = calloc(sm->n, sizeof(bam_pileup1_t*));
 
     iter = bam_mplp_init(n, mplp_func, (void**)data);
-    bam_mplp_set_maxcnt(iter, 8000);
+    if (conf->flag & MPLP_GLF) bam_mplp_constructor(iter, mplp_smpl_cd); // sample ids are only needed for calling
+    bam_mplp_set_maxcnt(iter, params->max_depth);
 	
-	memset(&buf, 0, sizeof(kstring_t));
 	memset(&bc, 0, sizeof(bcf_call_t));
-    while (bam_mplp_auto(iter, &tid, &pos, n_plp, plp) > 0) {
+    while ((n_idx = bam_mplp_auto_sparse(iter, &tid, &pos, &idx, n_plp, plp)) > 0) {
         if (conf->reg && (pos < beg0 || pos >= end0)) continue; // out of the region requested
         if (data[0]->bed && tid >= 0 && !bed_overlap(data[0]->bed, h->target_name[tid], pos, pos+1)) continue;
         if (tid != ref_tid) {
@@ -371,26 +709,38 @@ void * mpileup_kern (
 //            pthread_mutex_lock(&write_lock);
             if (fai) ref = faidx_fetch_seq(fai, h->target_name[tid], 0, 0x7fffffff, &ref_len);
 //            pthread_mutex_unlock(&write_lock);
+            md5 = params->md5? baqc_md5_get(params->md5, tid, ref, ref_len) : 0;
             for (i = 0; i < n; ++i) {
                 data[i]->ref = ref;
                 data[i]->ref_id = tid;
                 data[i]->ref_len = ref_len;
+                if (data[i]->bql) baqc_set_ref(data[i]->bql, tid, md5);
             }
             ref_tid = tid;
         }
         if (conf->flag & MPLP_GLF) {
             int total_depth, _ref0, ref16;
-            bcf1_t *b = calloc(1, sizeof(bcf1_t));
-            for (i = total_depth = 0; i < n; ++i) total_depth += n_plp[i];
-            group_smpl(&gplp, sm, &buf, n, fn, n_plp, plp, conf->flag & MPLP_IGNORE_RG);
+            bcf1_t *b = bcf_pool_get(params->pool);
+            for (i = total_depth = 0; i < n_idx; ++i) total_depth += n_plp[i];
+            group_smpl(&gplp, n_idx, idx, fn, n_plp, plp);
             _ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
             ref16 = bam_nt16_table[_ref0];
+            bcf_call_srand(bca, tid, pos);
             for (i = 0; i < gplp.n; ++i)
                 bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], ref16, bca, bcr + i);
             bcf_call_combine(gplp.n, bcr, bca, ref16, &bc);
-            bcf_call2bcf(tid, pos, &bc, b, bcr, conf->fmt_flag, 0, 0);
+            bcf_call2bcf(tid, pos, &bc, b, bcr, conf->fmt_flag, bca, 0); // bca for its Fisher test cache only
 //            pthread_mutex_lock(&write_lock);
-            bcf_write_queue(bp, bh, b);
+            if (p1 && (conf->flag & MPLP_GVCF)) {
+                // non-variant sites go to the blocks uncalled, so that they keep their PL, with the QUAL of the call
+                if (mplp_is_ref(b) || !bcf_vc_call1(b, p1, em, .5, 1)) {
+                    b->qual = bcf_vc_ref_qual(b, p1);
+                    if (!mplp_is_ref(b)) mplp_block_ref(&blk, b);
+                }
+                if (!mplp_block_push(&blk, b, bc.ori_depth, bp, bh)) bcf_write_queue(bp, bh, b);
+            } else if (p1 && !bcf_vc_call1(b, p1, em, .5, 1)) bcf_pool_put(b);
+            else if (!(conf->flag & MPLP_GVCF) || !mplp_block_push(&blk, b, bc.ori_depth, bp, bh))
+                bcf_write_queue(bp, bh, b);
 //            pthread_mutex_unlock(&write_lock);
 //            bcf_destroy(b);
             // call indels
@@ -398,10 +748,12 @@ void * mpileup_kern (
                 for (i = 0; i < gplp.n; ++i)
                     bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], -1, bca, bcr + i);
                 if (bcf_call_combine(gplp.n, bcr, bca, -1, &bc) >= 0) {
-                    b = calloc(1, sizeof(bcf1_t));
+                    b = bcf_pool_get(params->pool);
                     bcf_call2bcf(tid, pos, &bc, b, bcr, conf->fmt_flag, bca, ref);
 //                    pthread_mutex_lock(&write_lock);
-                    bcf_write_queue(bp, bh, b);
+                    mplp_block_flush(&blk, bp, bh); // the indel follows the block ending here
+                    if (p1 && !bcf_vc_call1(b, p1, em, .5, 1)) bcf_pool_put(b);
+                    else bcf_write_queue(bp, bh, b);
 //                    pthread_mutex_unlock(&write_lock);
 //                    bcf_destroy(b);
                 }
@@ -423,15 +775,18 @@ void * mpileup_kern (
 			 * 
 			 * @date 2014-mar-03
 			 */
+			int k;
 			
 			stdout_buffer.l = 0;
 			
 			ksprintf(&stdout_buffer, "%s\t%d\t%c", h->target_name[tid], pos + 1, (ref && pos < ref_len)? ref[pos] : 'N');// replaces: printf("%s\t%d\t%c", h->target_name[tid], pos + 1, (ref && pos < ref_len)? ref[pos] : 'N');
 			
-			for (i = 0; i < n; ++i) {
-				int j, cnt;
-				for (j = cnt = 0; j < n_plp[i]; ++j) {
-					const bam_pileup1_t *p = plp[i] + j;
+			for (i = k = 0; i < n; ++i) {
+				int j, cnt, n_plpi = 0;
+				const bam_pileup1_t *plpi = 0;
+				if (k < n_idx && idx[k] == i) n_plpi = n_plp[k], plpi = plp[k], ++k; // files without coverage are not in idx[]
+				for (j = cnt = 0; j < n_plpi; ++j) {
+					const bam_pileup1_t *p = plpi + j;
 					if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ) {
 						++cnt;
 					}
@@ -439,7 +794,7 @@ void * mpileup_kern (
 				
 				ksprintf(&stdout_buffer, "\t%d\t", cnt);
 				
-				if (n_plp[i] == 0) {
+				if (n_plpi == 0) {
 					ksprintf(&stdout_buffer, "*\t*", cnt);// replaces: printf("*\t*"); // FIXME: printf() is very slow...
 					
 					if (conf->flag & MPLP_PRINT_POS)
@@ -447,18 +802,18 @@ void * mpileup_kern (
 						ksprintf(&stdout_buffer, "\t*", cnt);// replaces: printf("\t*");
 					}
 				} else {
-					for (j = 0; j < n_plp[i]; ++j) {
-						const bam_pileup1_t *p = plp[i] + j;
+					for (j = 0; j < n_plpi; ++j) {
+						const bam_pileup1_t *p = plpi + j;
 						if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ)
 						{
-							kpileup_seq(plp[i] + j, pos, ref_len, ref, &stdout_buffer);// replaces: pileup_seq(plp[i] + j, pos, ref_len, ref);
+							kpileup_seq(plpi + j, pos, ref_len, ref, &stdout_buffer);// replaces: pileup_seq(plp[i] + j, pos, ref_len, ref);
 						}
 					}
 					
 					
 					kputc('\t', &stdout_buffer);// replaces: putchar('\t');
-					for (j = 0; j < n_plp[i]; ++j) {
-						const bam_pileup1_t *p = plp[i] + j;
+					for (j = 0; j < n_plpi; ++j) {
+						const bam_pileup1_t *p = plpi + j;
 						int c = bam1_qual(p->b)[p->qpos];
 						if (c >= conf->min_baseQ) {
 							c = c + 33 < 126? c + 33 : 126;
@@ -467,19 +822,19 @@ void * mpileup_kern (
 					}
 					if (conf->flag & MPLP_PRINT_MAPQ) {
 						kputc('\t', &stdout_buffer);// replaces: putchar('\t');
-						for (j = 0; j < n_plp[i]; ++j) {
-							int c = plp[i][j].b->core.qual + 33;
+						for (j = 0; j < n_plpi; ++j) {
+							int c = plpi[j].b->core.qual + 33;
 							if (c > 126) c = 126;
 							kputc(c, &stdout_buffer);// replaces: putchar(c);
 						}
 					}
 					if (conf->flag & MPLP_PRINT_POS) {
 						kputc('\t', &stdout_buffer);// replaces: putchar('\t');
-						for (j = 0; j < n_plp[i]; ++j) {
+						for (j = 0; j < n_plpi; ++j) {
 							if (j > 0){
 								kputc(',', &stdout_buffer);// replaces: putchar(',');
 							}
-							ksprintf(&stdout_buffer, "%d", plp[i][j].qpos + 1);//replaces: printf("%d", plp[i][j].qpos + 1); // FIXME: printf() is very slow...
+							ksprintf(&stdout_buffer, "%d", plpi[j].qpos + 1);//replaces: printf("%d", plp[i][j].qpos + 1); // FIXME: printf() is very slow...
 						}
 					}
 				}
@@ -497,12 +852,34 @@ void * mpileup_kern (
 	
 	/** ------------------------- end fix --------------------------- */
 	
-    free(n_plp); free(plp); free(buf.s); free(stdout_buffer.s);
+    params->baq_stat[0] = params->baq_stat[1] = 0;
+    for (i = 0; i < n_baq; ++i) {
+        long n_read, n_skip;
+        bam_baq_buf_stat(baq[i], &n_read, &n_skip);
+        params->baq_stat[0] += n_read, params->baq_stat[1] += n_skip;
+    }
+    if (bca) {
+        mplp_block_flush(&blk, bp, bh);
+        free(blk.info.s); free(blk.tmp.s);
+        if (p1) bcf_p1_destroy(p1);
+        bcf_em_destroy(em);
+        params->indel_stat[0] = bca->n_realn, params->indel_stat[1] = bca->n_realn_hit;
+        bcf_call_destroy(bca);
+        kt_pool_destroy(indel_pool);
+    }
+    for (i = 0; i < n; ++i) {
+        if (data[i]->bql) baqc_local_destroy(data[i]->bql);
+        mplp_batch_destroy(data[i]->bt);
+    }
+    free(n_plp); free(plp); free(stdout_buffer.s);
 	free(bc.PL); free(bcr);
     free(params);
     for (i = 0; i < gplp.n; ++i) free(gplp.plp[i]);
     free(gplp.plp); free(gplp.n_plp); free(gplp.m_plp);
     bam_mplp_destroy(iter);
+    kt_pool_destroy(pool);
+    for (i = 0; i < n_baq; ++i) bam_baq_buf_destroy(baq[i]);
+    free(baq);
     pthread_exit(NULL);
 }
 
@@ -516,6 +893,9 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 	char *ref;
 	void *rghash = 0;
     pthread_t *threads;
+    long *baq_stat, *indel_stat;
+    bcf_pool_t **pools = 0;
+    baqc_md5_t *md5 = 0;
 
 	bcf_callaux_t *bca = 0;
 	bcf_t *bp = 0;
@@ -537,6 +917,8 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
             exit(1);
         }
 		data[i]->conf = conf;
+		data[i]->file = i;
+		data[i]->sm = sm;
 		h_tmp = bam_header_read(data[i]->fp);
         if ( !h_tmp ) {
             fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, fn[i]);
@@ -605,8 +987,14 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
             kputs(">\n", &s);
         }
         if (tbl) free(tbl);
+        if (conf->flag & MPLP_GVCF) {
+            kputs("##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position of the reference block starting at POS\">\n", &s);
+            kputs("##INFO=<ID=MinDP,Number=1,Type=Integer,Description=\"Minimum depth in the reference block; the other INFO is from the site of this depth\">\n", &s);
+            kputs("##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype Quality; of a reference block, the smaller of its non-reference PLs minimized over the block\">\n", &s);
+        }
 		bh->txt = s.s;
 		bh->l_txt = 1 + s.l;
+		if (conf->flag & MPLP_CALL) bcf_vc_header(bh);
 		bcf_hdr_sync(bh);
 		bcf_hdr_write(bp, bh);
 		bca = bcf_call_init(-1., conf->min_baseQ);
@@ -616,6 +1004,12 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 		bca->min_support = conf->min_support;
         bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
 	}
+	if ((conf->flag & MPLP_BAQ_CACHE) && (conf->flag & MPLP_REALN) && conf->fai) {
+		// the sidecar is only valid for the settings that change BAQ
+		int param = mplp_baq_flag(conf) | (conf->flag & MPLP_BAQ_FP32? 16 : 0) | (conf->flag & MPLP_ILLUMINA13? 32 : 0);
+		for (i = 0; i < n; ++i) data[i]->bqc = baqc_open(fn[i], param);
+		md5 = baqc_md5_init(h->n_targets);
+	}
 	if (tid0 >= 0 && conf->fai) { // region is set
 		ref = faidx_fetch_seq(conf->fai, h->target_name[tid0], 0, 0x7fffffff, &ref_len);
 		ref_tid = tid0;
@@ -635,6 +1029,9 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 	max_indel_depth = conf->max_indel_depth * sm->n;
 
     threads = calloc(conf->num_threads, sizeof(pthread_t));
+    baq_stat = calloc(conf->num_threads * 2, sizeof(long));
+    indel_stat = calloc(conf->num_threads * 2, sizeof(long));
+    if (conf->flag & MPLP_GLF) pools = calloc(conf->num_threads, sizeof(void*));
     for (i = 0; i < conf->num_threads; i++) {
         int j;
         void *rghash = 0;
@@ -683,8 +1080,13 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
         kernel_args->sm = sm;
         kernel_args->bp = bp;
         kernel_args->bh = bh;
+        kernel_args->max_depth = max_depth;
         kernel_args->max_indel_depth = max_indel_depth;
         kernel_args->rghash = rghash;
+        kernel_args->baq_stat = &baq_stat[i * 2];
+        kernel_args->indel_stat = &indel_stat[i * 2];
+        if (pools) kernel_args->pool = pools[i] = bcf_pool_init();
+        kernel_args->md5 = md5;
 
         pthread_create(&threads[i], NULL, mpileup_kern, kernel_args);
 	}
@@ -692,8 +1094,27 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
         pthread_join(threads[i], NULL);
 
     }
+    if (conf->flag & MPLP_BAQ_SKIP) {
+        long n_read = 0, n_skip = 0;
+        for (i = 0; i < conf->num_threads; ++i)
+            n_read += baq_stat[i*2], n_skip += baq_stat[i*2+1];
+        fprintf(stderr, "[%s] %ld of %ld reads (%.2f%%) matched the reference and skipped the BAQ HMM\n",
+                __func__, n_skip, n_read, n_read? 100. * n_skip / n_read : 0.);
+    }
+    if (bam_verbose >= 3 && (conf->flag & MPLP_GLF) && !(conf->flag & MPLP_NO_INDEL)) {
+        long n_realn = 0, n_hit = 0;
+        for (i = 0; i < conf->num_threads; ++i)
+            n_realn += indel_stat[i*2], n_hit += indel_stat[i*2+1];
+        fprintf(stderr, "[%s] %ld of %ld reads (%.2f%%) at indel sites were scored from the per-site realignment cache\n",
+                __func__, n_hit, n_realn, n_realn? 100. * n_hit / n_realn : 0.);
+    }
+    free(baq_stat); free(indel_stat);
+    for (i = 0; i < n; ++i) baqc_close(data[i]->bqc, 1);
+    baqc_md5_destroy(md5);
     if (conf->flag & MPLP_GLF) {
         bcf_write_queue_destroy(bp, bh);
+        for (i = 0; i < conf->num_threads; ++i) bcf_pool_destroy(pools[i]);
+        free(pools);
     }
 
 	bcf_close(bp);
@@ -788,12 +1209,30 @@ int bam_mpileup(int argc, char *argv[])
     {
         {"rf",1,0,1},   // require flag
         {"ff",1,0,2},   // filter flag
+        {"baq-fp32",0,0,3}, // single-precision BAQ
+        {"baq-skip",0,0,4}, // no BAQ HMM for exact matches
+        {"baq-cache",0,0,5}, // BAQ sidecar files
+        {"baq-threads",1,0,6}, // threads computing BAQ for batches of reads
+        {"verbose",1,0,7},
+        {"indel-threads",1,0,8}, // threads realigning reads at deep indel sites
+        {"seed",1,0,9}, // downsampling of columns deeper than 255 reads
+        {"gvcf",0,0,10}, // merge runs of reference sites into blocks
+        {"call",0,0,11}, // call variants as bcftools view -vcg
         {0,0,0,0}
     };
 	while ((c = getopt_long(argc, argv, "Agf:r:l:M:q:Q:uaRC:BDSd:L:b:P:t:po:e:h:Im:F:EG:6OsV1:2:",lopts,NULL)) >= 0) {
 		switch (c) {
         case  1 : mplp.rflag_require = strtol(optarg,0,0); break;
         case  2 : mplp.rflag_filter  = strtol(optarg,0,0); break;
+        case  3 : kpa_set_simd(KPA_SIMD_FLOAT); mplp.flag |= MPLP_BAQ_FP32; break;
+        case  4 : mplp.flag |= MPLP_BAQ_SKIP; break;
+        case  5 : mplp.flag |= MPLP_BAQ_CACHE; break;
+        case  6 : mplp.baq_threads = atoi(optarg); break;
+        case  7 : bam_verbose = atoi(optarg); break;
+        case  8 : mplp.indel_threads = atoi(optarg); break;
+        case  9 : mplp.seed = atoi(optarg); break;
+        case 10 : mplp.flag |= MPLP_GVCF; break;
+        case 11 : mplp.flag |= MPLP_CALL | MPLP_GLF; break;
 		case 'f':
 			mplp.fai = fai_load(optarg);
 			if (mplp.fai == 0) return 1;
@@ -853,8 +1292,14 @@ int bam_mpileup(int argc, char *argv[])
 		fprintf(stderr, "       -B           disable BAQ computation\n");
 		fprintf(stderr, "       -b FILE      list of input BAM filenames, one per line [null]\n");
 		fprintf(stderr, "       -C INT       parameter for adjusting mapQ; 0 to disable [0]\n");
-		fprintf(stderr, "       -d INT       max per-BAM depth to avoid excessive memory usage [%d]\n", mplp.max_depth);
+		fprintf(stderr, "       -d INT       max per-BAM depth; deeper reads are downsampled [%d]\n", mplp.max_depth);
 		fprintf(stderr, "       -E           recalculate extended BAQ on the fly thus ignoring existing BQs\n");
+		fprintf(stderr, "       --baq-fp32   compute BAQ in single precision (faster; BAQ may differ by 1)\n");
+		fprintf(stderr, "       --baq-skip   keep the base quality of reads exactly matching the reference\n");
+		fprintf(stderr, "                    instead of running the BAQ HMM (faster; approximate near read ends)\n");
+		fprintf(stderr, "       --baq-cache  reuse BAQ from, or save it to, <in.bam>.baq\n");
+		fprintf(stderr, "       --baq-threads INT\n");
+		fprintf(stderr, "                    threads computing BAQ of reads read ahead, per -t thread [%d]\n", mplp.baq_threads);
 		fprintf(stderr, "       -f FILE      faidx indexed reference sequence file [null]\n");
 		fprintf(stderr, "       -G FILE      exclude read groups listed in FILE [null]\n");
 		fprintf(stderr, "       -l FILE      list of positions (chr pos) or regions (BED) [null]\n");
@@ -869,20 +1314,28 @@ int bam_mpileup(int argc, char *argv[])
 		fprintf(stderr, "\nOutput options:\n\n");
 		fprintf(stderr, "       -D           output per-sample DP in BCF (require -g/-u)\n");
 		fprintf(stderr, "       -g           generate BCF output (genotype likelihoods)\n");
+		fprintf(stderr, "       --call       output the variants called by \"bcftools view -vcg\" (force -g);\n                    with --gvcf, non-variant sites go to reference blocks\n");
+		fprintf(stderr, "       --gvcf       merge consecutive sites without ALT evidence into one record\n");
+		fprintf(stderr, "                    with END; FORMAT fields are the minima over the block\n");
 		fprintf(stderr, "       -O           output base positions on reads (disabled by -g/-u)\n");
 		fprintf(stderr, "       -s           output mapping quality (disabled by -g/-u)\n");
 		fprintf(stderr, "       -S           output per-sample strand bias P-value in BCF (require -g/-u)\n");
 		fprintf(stderr, "       -u           generate uncompress BCF output\n");
+		fprintf(stderr, "       --verbose INT\n");
+		fprintf(stderr, "                    verbosity; 3 or higher prints run statistics [%d]\n", bam_verbose);
 		fprintf(stderr, "\nSNP/INDEL genotype likelihoods options (effective with `-g' or `-u'):\n\n");
 		fprintf(stderr, "       -e INT       Phred-scaled gap extension seq error probability [%d]\n", mplp.extQ);
 		fprintf(stderr, "       -F FLOAT     minimum fraction of gapped reads for candidates [%g]\n", mplp.min_frac);
 		fprintf(stderr, "       -h INT       coefficient for homopolymer errors [%d]\n", mplp.tandemQ);
 		fprintf(stderr, "       -I           do not perform indel calling\n");
+		fprintf(stderr, "       --indel-threads INT\n");
+		fprintf(stderr, "                    threads realigning reads at deep indel sites, per -t thread [%d]\n", mplp.indel_threads);
 		fprintf(stderr, "       -L INT       max per-sample depth for INDEL calling [%d]\n", mplp.max_indel_depth);
 		fprintf(stderr, "       -m INT       minimum gapped reads for indel candidates [%d]\n", mplp.min_support);
 		fprintf(stderr, "       -o INT       Phred-scaled gap open sequencing error probability [%d]\n", mplp.openQ);
 		fprintf(stderr, "       -p           apply -m and -F per-sample to increase sensitivity\n");
 		fprintf(stderr, "       -P STR       comma separated list of platforms for indels [all]\n");
+		fprintf(stderr, "       --seed INT   seed for sampling 255 bases of deeper columns [%d]\n", mplp.seed);
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Notes: Assuming diploid individuals.\n\n");
 		return 1;
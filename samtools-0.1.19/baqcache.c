@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "kstring.h"
+#include "ksort.h"
+#include "misc/md5.h"
+#include "baqcache.h"
+
+/* The sidecar is written in the native byte order; all offsets are 8-byte aligned:
+
+     char[4]  magic "BAQ\1"
+     int32    BAQ parameters
+     int64    size and modification time of the BAM
+     int32    n_ref, padding
+     n_ref x {int32 tid, padding, uint8[16] MD5 of the upper-cased sequence}
+     uint64   n_rec
+     n_rec x {uint64 virtual offset past the record, uint64 offset in the data block}, sorted
+     data     per record: uint32 l_qseq, then (run,value) byte pairs covering l_qseq bytes of ZQ
+ */
+
+#define BAQC_MAGIC "BAQ\1"
+
+typedef struct {
+	uint64_t voff, off;
+} baqc_rec_t;
+
+typedef struct {
+	int32_t tid, pad;
+	uint8_t md5[16];
+} baqc_ref_t;
+
+#define baqc_rec_lt(a, b) ((a).voff < (b).voff)
+KSORT_INIT(baqc, baqc_rec_t, baqc_rec_lt)
+
+struct __baqc_t {
+	char *fn;
+	int param, is_write;
+	int64_t size, mtime;
+	pthread_mutex_t lock;
+	long n_hit, n_miss;
+	// reading
+	uint8_t *map;
+	size_t l_map;
+	int n_ref;
+	const baqc_ref_t *ref;
+	uint64_t n_rec;
+	const baqc_rec_t *rec;
+	const uint8_t *data;
+	// writing
+	int n_wref, m_wref;
+	baqc_ref_t *wref;
+	size_t n_wrec, m_wrec;
+	baqc_rec_t *wrec;
+	kstring_t wdata;
+};
+
+struct __baqc_local_t {
+	baqc_t *bc;
+	int ok; // whether the current reference can be used
+	long n_hit, n_miss;
+	size_t n_rec, m_rec;
+	baqc_rec_t *rec;
+	kstring_t data;
+	int m_bq;
+	uint8_t *bq;
+};
+
+// 1 if the sidecar is usable; bc->map is set in any case if it could be mapped
+static int baqc_map(baqc_t *bc)
+{
+	int fd, n_ref;
+	struct stat st;
+	const uint8_t *p;
+	uint64_t n_rec;
+	int32_t param;
+	int64_t size, mtime;
+	if ((fd = open(bc->fn, O_RDONLY)) < 0) return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < 40) {
+		close(fd);
+		return 0;
+	}
+	bc->l_map = st.st_size;
+	bc->map = mmap(0, bc->l_map, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (bc->map == MAP_FAILED) {
+		bc->map = 0;
+		return 0;
+	}
+	p = bc->map;
+	if (memcmp(p, BAQC_MAGIC, 4) != 0) return 0;
+	memcpy(&param, p + 4, 4); memcpy(&size, p + 8, 8); memcpy(&mtime, p + 16, 8);
+	if (param != bc->param || size != bc->size || mtime != bc->mtime) return 0;
+	memcpy(&n_ref, p + 24, 4);
+	if (n_ref < 0 || 32 + (uint64_t)n_ref * sizeof(baqc_ref_t) + 8 > bc->l_map) return 0;
+	bc->n_ref = n_ref;
+	bc->ref = (const baqc_ref_t*)(p + 32);
+	p += 32 + n_ref * sizeof(baqc_ref_t);
+	memcpy(&n_rec, p, 8);
+	if (n_rec > (bc->l_map - (p + 8 - bc->map)) / sizeof(baqc_rec_t)) return 0;
+	bc->n_rec = n_rec;
+	bc->rec = (const baqc_rec_t*)(p + 8);
+	bc->data = p + 8 + n_rec * sizeof(baqc_rec_t);
+	return 1;
+}
+
+baqc_t *baqc_open(const char *fn, int param)
+{
+	baqc_t *bc;
+	struct stat st;
+	if (strcmp(fn, "-") == 0 || stat(fn, &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+	bc = calloc(1, sizeof(baqc_t));
+	bc->fn = malloc(strlen(fn) + 5);
+	strcat(strcpy(bc->fn, fn), ".baq");
+	bc->param = param;
+	bc->size = st.st_size; bc->mtime = st.st_mtime;
+	pthread_mutex_init(&bc->lock, 0);
+	if (!baqc_map(bc)) {
+		if (bc->map) {
+			fprintf(stderr, "[%s] %s does not match the BAM or the BAQ settings; it will be rewritten.\n", __func__, bc->fn);
+			munmap(bc->map, bc->l_map);
+			bc->map = 0;
+		}
+		bc->n_ref = 0; bc->n_rec = 0;
+		bc->is_write = 1;
+	}
+	return bc;
+}
+
+// the length of the encoded record at p
+static size_t baqc_rec_len(const uint8_t *p)
+{
+	const uint8_t *q = p + 4;
+	uint32_t l, k;
+	memcpy(&l, p, 4);
+	for (k = 0; k < l; q += 2) k += q[0];
+	return q - p;
+}
+
+static void baqc_write(baqc_t *bc)
+{
+	FILE *fp;
+	kstring_t tmp;
+	size_t i, n;
+	uint64_t off, n_rec;
+	int32_t pad = 0;
+	tmp.l = tmp.m = 0; tmp.s = 0;
+	ksprintf(&tmp, "%s.tmp", bc->fn);
+	if ((fp = fopen(tmp.s, "wb")) == 0) {
+		fprintf(stderr, "[%s] fail to write %s\n", __func__, tmp.s);
+		free(tmp.s);
+		return;
+	}
+	// sort and remove the reads seen by more than one thread
+	ks_introsort(baqc, bc->n_wrec, bc->wrec);
+	for (i = n = 0; i < bc->n_wrec; ++i)
+		if (n == 0 || bc->wrec[i].voff != bc->wrec[n-1].voff)
+			bc->wrec[n++] = bc->wrec[i];
+	bc->n_wrec = n;
+	fwrite(BAQC_MAGIC, 1, 4, fp);
+	fwrite(&bc->param, 4, 1, fp); fwrite(&bc->size, 8, 1, fp); fwrite(&bc->mtime, 8, 1, fp);
+	fwrite(&bc->n_wref, 4, 1, fp); fwrite(&pad, 4, 1, fp);
+	fwrite(bc->wref, sizeof(baqc_ref_t), bc->n_wref, fp);
+	n_rec = n;
+	fwrite(&n_rec, 8, 1, fp);
+	for (i = 0, off = 0; i < n; ++i) {
+		baqc_rec_t r;
+		r.voff = bc->wrec[i].voff; r.off = off;
+		fwrite(&r, sizeof(baqc_rec_t), 1, fp);
+		off += baqc_rec_len((uint8_t*)bc->wdata.s + bc->wrec[i].off);
+	}
+	for (i = 0; i < n; ++i) {
+		const uint8_t *p = (uint8_t*)bc->wdata.s + bc->wrec[i].off;
+		fwrite(p, 1, baqc_rec_len(p), fp);
+	}
+	if (fclose(fp) != 0 || rename(tmp.s, bc->fn) != 0) {
+		fprintf(stderr, "[%s] fail to write %s\n", __func__, bc->fn);
+		unlink(tmp.s);
+	}
+	free(tmp.s);
+}
+
+void baqc_close(baqc_t *bc, int is_verbose)
+{
+	if (bc == 0) return;
+	if (bc->is_write) {
+		baqc_write(bc);
+		if (is_verbose)
+			fprintf(stderr, "[%s] wrote BAQ of %ld reads to %s\n", __func__, (long)bc->n_wrec, bc->fn);
+	} else if (is_verbose) {
+		fprintf(stderr, "[%s] BAQ of %ld reads taken from %s; %ld computed\n", __func__, bc->n_hit, bc->fn, bc->n_miss);
+	}
+	if (bc->map) munmap(bc->map, bc->l_map);
+	pthread_mutex_destroy(&bc->lock);
+	free(bc->wref); free(bc->wrec); free(bc->wdata.s);
+	free(bc->fn); free(bc);
+}
+
+baqc_local_t *baqc_local_init(baqc_t *bc)
+{
+	baqc_local_t *lc = calloc(1, sizeof(baqc_local_t));
+	lc->bc = bc;
+	return lc;
+}
+
+void baqc_local_destroy(baqc_local_t *lc)
+{
+	baqc_t *bc = lc->bc;
+	size_t i;
+	pthread_mutex_lock(&bc->lock);
+	bc->n_hit += lc->n_hit; bc->n_miss += lc->n_miss;
+	if (bc->is_write && lc->n_rec) {
+		if (bc->n_wrec + lc->n_rec > bc->m_wrec) {
+			bc->m_wrec = bc->n_wrec + lc->n_rec;
+			bc->wrec = realloc(bc->wrec, bc->m_wrec * sizeof(baqc_rec_t));
+		}
+		for (i = 0; i < lc->n_rec; ++i) {
+			bc->wrec[bc->n_wrec] = lc->rec[i];
+			bc->wrec[bc->n_wrec++].off += bc->wdata.l;
+		}
+		kputsn(lc->data.s, lc->data.l, &bc->wdata);
+	}
+	pthread_mutex_unlock(&bc->lock);
+	free(lc->rec); free(lc->data.s); free(lc->bq);
+	free(lc);
+}
+
+struct __baqc_md5_t {
+	pthread_mutex_t lock;
+	int n_ref;
+	uint8_t *done, (*md5)[16];
+};
+
+baqc_md5_t *baqc_md5_init(int n_ref)
+{
+	baqc_md5_t *m = calloc(1, sizeof(baqc_md5_t));
+	pthread_mutex_init(&m->lock, 0);
+	m->n_ref = n_ref;
+	m->done = calloc(n_ref, 1);
+	m->md5 = calloc(n_ref, 16);
+	return m;
+}
+
+void baqc_md5_destroy(baqc_md5_t *m)
+{
+	if (m == 0) return;
+	pthread_mutex_destroy(&m->lock);
+	free(m->done); free(m->md5); free(m);
+}
+
+const uint8_t *baqc_md5_get(baqc_md5_t *m, int tid, const char *ref, int len)
+{
+	MD5_CTX ctx;
+	uint8_t buf[4096];
+	int i, k;
+	if (ref == 0 || tid < 0 || tid >= m->n_ref) return 0;
+	pthread_mutex_lock(&m->lock); // held while hashing: other threads want the same tid anyway
+	if (!m->done[tid]) {
+		MD5Init(&ctx);
+		for (i = k = 0; i < len; ++i) {
+			if (!isalpha((unsigned char)ref[i])) continue;
+			buf[k++] = toupper((unsigned char)ref[i]);
+			if (k == sizeof(buf)) MD5Update(&ctx, buf, k), k = 0;
+		}
+		MD5Update(&ctx, buf, k);
+		MD5Final(m->md5[tid], &ctx);
+		m->done[tid] = 1;
+	}
+	pthread_mutex_unlock(&m->lock);
+	return m->md5[tid];
+}
+
+int baqc_set_ref(baqc_local_t *lc, int tid, const uint8_t *md5)
+{
+	baqc_t *bc = lc->bc;
+	int i;
+	lc->ok = 0;
+	if (md5 == 0) return 0;
+	if (bc->is_write) {
+		pthread_mutex_lock(&bc->lock);
+		for (i = 0; i < bc->n_wref; ++i)
+			if (bc->wref[i].tid == tid) break;
+		if (i == bc->n_wref) {
+			if (bc->n_wref == bc->m_wref) {
+				bc->m_wref = bc->m_wref? bc->m_wref<<1 : 16;
+				bc->wref = realloc(bc->wref, bc->m_wref * sizeof(baqc_ref_t));
+			}
+			memset(&bc->wref[i], 0, sizeof(baqc_ref_t));
+			bc->wref[i].tid = tid;
+			memcpy(bc->wref[i].md5, md5, 16);
+			++bc->n_wref;
+		}
+		lc->ok = (memcmp(bc->wref[i].md5, md5, 16) == 0);
+		pthread_mutex_unlock(&bc->lock);
+	} else {
+		for (i = 0; i < bc->n_ref; ++i)
+			if (bc->ref[i].tid == tid) break;
+		lc->ok = (i < bc->n_ref && memcmp(bc->ref[i].md5, md5, 16) == 0);
+	}
+	return lc->ok;
+}
+
+int baqc_apply(baqc_local_t *lc, uint64_t voff, bam1_t *b)
+{
+	baqc_t *bc = lc->bc;
+	const uint8_t *p, *end = bc->map + bc->l_map;
+	uint8_t *qual = bam1_qual(b);
+	uint64_t lo = 0, hi = bc->n_rec;
+	uint32_t l, k;
+	int i;
+	if (bc->is_write || !lc->ok) return 0;
+	while (lo < hi) { // binary search for voff
+		uint64_t mid = (lo + hi) >> 1;
+		if (bc->rec[mid].voff < voff) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == bc->n_rec || bc->rec[lo].voff != voff) goto miss;
+	p = bc->data + bc->rec[lo].off;
+	if (p + 4 > end) goto miss;
+	memcpy(&l, p, 4);
+	if (l != b->core.l_qseq) goto miss;
+	if (l + 1 > lc->m_bq) {
+		lc->m_bq = l + 1; kroundup32(lc->m_bq);
+		lc->bq = realloc(lc->bq, lc->m_bq);
+	}
+	for (p += 4, k = 0; k < l; p += 2) {
+		if (p + 2 > end || p[0] == 0 || k + p[0] > l) goto miss;
+		memset(lc->bq + k, p[1], p[0]);
+		k += p[0];
+	}
+	lc->bq[l] = 0;
+	for (i = 0; i < l; ++i) qual[i] -= lc->bq[i] - 64;
+	bam_aux_append(b, "ZQ", 'Z', l + 1, lc->bq);
+	++lc->n_hit;
+	return 1;
+miss:
+	++lc->n_miss;
+	return 0;
+}
+
+void baqc_push(baqc_local_t *lc, uint64_t voff, const bam1_t *b)
+{
+	uint8_t *zq;
+	uint32_t l = b->core.l_qseq, i, j;
+	if (!lc->bc->is_write || !lc->ok) return;
+	if ((zq = bam_aux_get(b, "ZQ")) == 0 || *zq++ != 'Z') return;
+	if (lc->n_rec == lc->m_rec) {
+		lc->m_rec = lc->m_rec? lc->m_rec<<1 : 1024;
+		lc->rec = realloc(lc->rec, lc->m_rec * sizeof(baqc_rec_t));
+	}
+	lc->rec[lc->n_rec].voff = voff;
+	lc->rec[lc->n_rec++].off = lc->data.l;
+	kputsn((char*)&l, 4, &lc->data);
+	for (i = 0; i < l; i = j) { // run-length encoding; most of ZQ is '@'
+		char run[2];
+		for (j = i + 1; j < l && j - i < 255 && zq[j] == zq[i]; ++j);
+		run[0] = j - i; run[1] = zq[i];
+		kputsn(run, 2, &lc->data);
+	}
+}
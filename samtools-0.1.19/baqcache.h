@@ -0,0 +1,40 @@
+#ifndef BAM_BAQCACHE_H
+#define BAM_BAQCACHE_H
+
+#include <stdint.h>
+#include "bam.h"
+
+/* A BAQ sidecar stores the ZQ array of each read of a BAM, keyed by the
+   virtual offset just past the record. It lives next to the BAM as
+   <in.bam>.baq and is only used if the BAM, the BAQ parameters and the MD5
+   of each reference sequence are the same as when it was written; otherwise
+   the records computed in this run are written to a new sidecar. */
+
+typedef struct __baqc_t baqc_t;             // one sidecar, shared by all threads
+typedef struct __baqc_local_t baqc_local_t; // per-thread state of one sidecar
+typedef struct __baqc_md5_t baqc_md5_t;     // reference MD5s, computed once per run
+
+// param identifies the BAQ settings; NULL if fn is not a regular file
+baqc_t *baqc_open(const char *fn, int param);
+// write the sidecar if it is being produced and free bc; print hits/misses if is_verbose
+void baqc_close(baqc_t *bc, int is_verbose);
+
+// per-reference MD5s shared by all sidecars and threads of a run
+baqc_md5_t *baqc_md5_init(int n_ref);
+void baqc_md5_destroy(baqc_md5_t *m);
+// MD5 of the uppercased residues of reference tid, hashed on first use only; NULL if ref is NULL; thread-safe
+const uint8_t *baqc_md5_get(baqc_md5_t *m, int tid, const char *ref, int len);
+
+baqc_local_t *baqc_local_init(baqc_t *bc);
+// hand the records of a thread over to bc and free lc; thread-safe
+void baqc_local_destroy(baqc_local_t *lc);
+
+// whether cached records of reference tid may be used; md5 from baqc_md5_get(), or NULL without a
+// reference; records the MD5 when writing; thread-safe
+int baqc_set_ref(baqc_local_t *lc, int tid, const uint8_t *md5);
+// apply the cached ZQ of the record ending at voff as bam_prob_realn_buf() would; 0 on a miss
+int baqc_apply(baqc_local_t *lc, uint64_t voff, bam1_t *b);
+// keep the ZQ tag of b, just computed, for the sidecar being produced
+void baqc_push(baqc_local_t *lc, uint64_t voff, const bam1_t *b);
+
+#endif
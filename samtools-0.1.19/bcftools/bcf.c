@@ -154,7 +154,10 @@ int bcf_sync(bcf1_t *b)
 		} else if (b->gi[i].fmt == bcf_str2int("GL", 2)) {
 			b->gi[i].len = b->n_alleles * (b->n_alleles + 1) / 2 * 4;
 		}
-		b->gi[i].data = realloc(b->gi[i].data, n_smpl * b->gi[i].len);
+		if (n_smpl * b->gi[i].len > b->gi[i].m_data) {
+			b->gi[i].m_data = n_smpl * b->gi[i].len;
+			b->gi[i].data = realloc(b->gi[i].data, b->gi[i].m_data);
+		}
 	}
 	return 0;
 }
@@ -172,11 +175,11 @@ int bcf_write_queue(bcf_t *bp, const bcf_hdr_t *h, const bcf1_t *b)
         int end = buf_head;
         while(i != end) {
             bcf_write(bp, h, b_buf[i]);
-            bcf_destroy(b_buf[i]);
+            bcf_pool_put(b_buf[i]);
             i = (i < BUF_SIZE - 1) ? i + 1 : 0;
         }
         bcf_write(bp, h, b);
-        bcf_destroy(b);
+        bcf_pool_put((bcf1_t*)b);
         pthread_mutex_lock(&buf_lock);
         buf_tail = end;
         if (buf_is_full) {
@@ -193,7 +196,7 @@ int bcf_write_queue(bcf_t *bp, const bcf_hdr_t *h, const bcf1_t *b)
         if (b_buf == NULL) {
             b_buf = calloc(BUF_SIZE, sizeof(bcf1_t *));
         }
-        b_buf[buf_head] = b;
+        b_buf[buf_head] = (bcf1_t*)b;
         buf_head = (buf_head < BUF_SIZE - 1) ? buf_head + 1 : 0;
         if (buf_head == buf_tail) {
             buf_is_full = 1;
@@ -211,7 +214,7 @@ int bcf_write_queue_destroy(bcf_t *bp, const bcf_hdr_t *h) {
     int i = buf_tail;
     while(i != buf_head) {
         bcf_write(bp, h, b_buf[i]);
-        bcf_destroy(b_buf[i]);
+        bcf_pool_put(b_buf[i]);
         i = (i < BUF_SIZE - 1) ? i + 1 : 0;
     }
     free(b_buf);
@@ -271,6 +274,58 @@ int bcf_destroy(bcf1_t *b)
 	return 0;
 }
 
+struct __bcf_pool_t {
+	pthread_mutex_t lock;
+	int n, m;
+	bcf1_t **a;
+};
+
+bcf_pool_t *bcf_pool_init(void)
+{
+	bcf_pool_t *p;
+	p = calloc(1, sizeof(bcf_pool_t));
+	pthread_mutex_init(&p->lock, 0);
+	return p;
+}
+
+void bcf_pool_destroy(bcf_pool_t *p)
+{
+	int i;
+	if (p == 0) return;
+	for (i = 0; i < p->n; ++i) bcf_destroy(p->a[i]);
+	pthread_mutex_destroy(&p->lock);
+	free(p->a); free(p);
+}
+
+bcf1_t *bcf_pool_get(bcf_pool_t *p)
+{
+	bcf1_t *b = 0;
+	pthread_mutex_lock(&p->lock);
+	if (p->n) b = p->a[--p->n];
+	pthread_mutex_unlock(&p->lock);
+	if (b == 0) {
+		b = calloc(1, sizeof(bcf1_t));
+		b->pool = p;
+	}
+	return b;
+}
+
+void bcf_pool_put(bcf1_t *b)
+{
+	bcf_pool_t *p = b->pool;
+	if (p == 0) {
+		bcf_destroy(b);
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	if (p->n == p->m) {
+		p->m = p->m? p->m<<1 : 16;
+		p->a = realloc(p->a, p->m * sizeof(void*));
+	}
+	p->a[p->n++] = b;
+	pthread_mutex_unlock(&p->lock);
+}
+
 static inline void fmt_str(const char *p, kstring_t *s)
 {
 	if (*p == 0) kputc('.', s);
@@ -438,14 +493,15 @@ int bcf_cpy(bcf1_t *r, const bcf1_t *b)
 {
 	char *t1 = r->str;
 	bcf_ginfo_t *t2 = r->gi;
+	bcf_pool_t *t5 = r->pool;
 	int i, t3 = r->m_str, t4 = r->m_gi;
 	*r = *b;
-	r->str = t1; r->gi = t2; r->m_str = t3; r->m_gi = t4;
+	r->str = t1; r->gi = t2; r->m_str = t3; r->m_gi = t4; r->pool = t5;
 	if (r->m_str < b->m_str) {
 		r->m_str = b->m_str;
 		r->str = realloc(r->str, r->m_str);
 	}
-	memcpy(r->str, b->str, r->m_str);
+	memcpy(r->str, b->str, b->l_str);
 	bcf_sync(r); // calling bcf_sync() is simple but inefficient
 	for (i = 0; i < r->n_gi; ++i)
 		memcpy(r->gi[i].data, b->gi[i].data, r->n_smpl * r->gi[i].len);
@@ -60,6 +60,7 @@ typedef struct {
 	uint32_t fmt; // format of the block, set by bcf_str2int(). 
 	int len; // length of data for each individual
 	void *data; // concatenated data
+	int m_data; // allocated size of data
 	// derived info: fmt, len (<-bcf1_t::fmt)
 } bcf_ginfo_t;
 
@@ -74,6 +75,7 @@ typedef struct {
 	int n_alleles, n_smpl; // number of alleles and samples
 	// derived info: ref, alt, flt, info, fmt (<-str), n_gi (<-fmt), n_alleles (<-alt), n_smpl (<-bcf_hdr_t::n_smpl)
     uint8_t *ploidy;    // ploidy of all samples; if NULL, ploidy of 2 is assumed.
+	struct __bcf_pool_t *pool; // if not NULL, the record goes back to this pool after bcf_write_queue()
 } bcf1_t;
 
 typedef struct {
@@ -95,6 +97,9 @@ typedef struct {
 struct __bcf_idx_t;
 typedef struct __bcf_idx_t bcf_idx_t;
 
+struct __bcf_pool_t;
+typedef struct __bcf_pool_t bcf_pool_t; // free records of one writing thread
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -123,6 +128,14 @@ extern "C" {
 	void bcf_hdr_destroy(bcf_hdr_t *h);
 	// destroy a record
 	int bcf_destroy(bcf1_t *b);
+	// records whose buffers are reused from site to site
+	bcf_pool_t *bcf_pool_init(void);
+	// free the pool and the records in it; records still queued for writing must have been written
+	void bcf_pool_destroy(bcf_pool_t *p);
+	// take a record from p, or allocate one if p is empty
+	bcf1_t *bcf_pool_get(bcf_pool_t *p);
+	// give b back to b->pool, or destroy it if b->pool is NULL; thread-safe
+	void bcf_pool_put(bcf1_t *b);
 	// BCF->VCF conversion
 	char *bcf_fmt(const bcf_hdr_t *h, bcf1_t *b);
 	// append more info
@@ -1,16 +1,15 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "bcf.h"
 #include "kstring.h"
 #include "khash.h"
+#include "ksort.h"
 KHASH_MAP_INIT_STR(str2id, int)
 
-#ifdef _WIN32
-#define srand48(x) srand(x)
-#define drand48() ((double)rand() / RAND_MAX)
-#endif
-
 // FIXME: valgrind report a memory leak in this function. Probably it does not get deallocated...
 void *bcf_build_refhash(bcf_hdr_t *h)
 {
@@ -352,16 +351,35 @@ int bcf_anno_max(bcf1_t *b)
 	return 0;
 }
 
+static uint64_t g_shuffle_x; // for seed <= 0, as drand48() used to be
+static pthread_once_t g_shuffle_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_shuffle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void shuffle_init(void)
+{
+	g_shuffle_x = ks_srand48_r(time(0) ^ getpid());
+}
+
 // FIXME: only data are shuffled; the header is NOT
+// seed > 0 gives the same permutation as srand48(seed) did; otherwise the permutation comes from a
+// process-wide stream seeded once from the time and pid, so successive calls differ
 int bcf_shuffle(bcf1_t *b, int seed)
 {
 	int i, j, *a;
-	if (seed > 0) srand48(seed);
+	uint64_t x; // not the global drand48(), so that concurrent shuffles do not interfere
+	if (seed > 0) x = ks_srand48_r(seed);
+	else {
+		pthread_once(&g_shuffle_once, shuffle_init);
+		pthread_mutex_lock(&g_shuffle_lock);
+		x = (uint64_t)ks_lrand48_r(&g_shuffle_x) << 17; // a fresh 48-bit state drawn from the stream
+		x = (x ^ ks_lrand48_r(&g_shuffle_x)) & 0xffffffffffffULL;
+		pthread_mutex_unlock(&g_shuffle_lock);
+	}
 	a = malloc(b->n_smpl * sizeof(int));
 	for (i = 0; i < b->n_smpl; ++i) a[i] = i;
 	for (i = b->n_smpl; i > 1; --i) {
 		int tmp;
-		j = (int)(drand48() * i);
+		j = (int)(ks_drand48_r(&x) * i);
 		tmp = a[j]; a[j] = a[i-1]; a[i-1] = tmp;
 	}
 	for (j = 0; j < b->n_gi; ++j) {
@@ -371,7 +389,7 @@ int bcf_shuffle(bcf1_t *b, int seed)
 		for (i = 0; i < b->n_smpl; ++i)
 			memcpy(swap + gi->len * a[i], data + gi->len * i, gi->len);
 		free(gi->data);
-		gi->data = swap;
+		gi->data = swap; gi->m_data = gi->len * b->n_smpl;
 	}
 	free(a);
 	return 0;
@@ -423,7 +441,7 @@ int bcf_subsam(int n_smpl, int *list, bcf1_t *b)
 		for (i = 0; i < n_smpl; ++i)
 			memcpy(swap + i * gi->len, (uint8_t*)gi->data + list[i] * gi->len, gi->len);
 		free(gi->data);
-		gi->data = swap;
+		gi->data = swap; gi->m_data = gi->len * b->n_smpl;
 	}
 	b->n_smpl = n_smpl;
 	return 0;
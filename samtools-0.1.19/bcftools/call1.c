@@ -7,11 +7,8 @@
 #include "prob1.h"
 #include "kstring.h"
 #include "time.h"
-
-#ifdef _WIN32
-#define srand48(x) srand(x)
-#define lrand48() rand()
-#endif
+#include "ksort.h"
+#include "kthread.h"
 
 #include "kseq.h"
 KSTREAM_INIT(gzFile, gzread, 16384)
@@ -36,7 +33,7 @@ KSTREAM_INIT(gzFile, gzread, 16384)
 #define VC_INDEL_ONLY 0x80000
 
 typedef struct {
-	int flag, prior_type, n1, n_sub, *sublist, n_perm;
+	int flag, prior_type, n1, n_sub, *sublist, n_perm, n_threads;
 	uint32_t *trio_aux;
 	char *prior_file, **subsam, *fn_dict;
 	uint8_t *ploidy;
@@ -149,6 +146,7 @@ static int update_bcf1(bcf1_t *b, const bcf_p1aux_t *pa, const bcf_p1rst_t *pr,
 			if (q[i] > 255) q[i] = 255;
 		}
 		if (pr->perm_rank >= 0) ksprintf(&s, ";PR=%d", pr->perm_rank);
+		if (pr->perm_n > 0) ksprintf(&s, ";PRN=%d", pr->perm_n);
 		// ksprintf(&s, ";LRT3=%.3g", pr->lrt);
 		ksprintf(&s, ";PCHI2=%.3g;PC2=%d,%d", q[1], q[2], pr->p_chi2);
 	}
@@ -239,7 +237,7 @@ static char **read_samples(const char *fn, int *_n)
 	return sam;
 }
 
-static void write_header(bcf_hdr_t *h)
+void bcf_vc_header(bcf_hdr_t *h)
 {
 	kstring_t str;
 	str.l = h->l_txt? h->l_txt - 1 : 0;
@@ -286,6 +284,8 @@ static void write_header(bcf_hdr_t *h)
         kputs("##INFO=<ID=QCHI2,Number=1,Type=Integer,Description=\"Phred scaled PCHI2.\">\n", &str);
     if (!strstr(str.s, "##INFO=<ID=RP,"))
         kputs("##INFO=<ID=PR,Number=1,Type=Integer,Description=\"# permutations yielding a smaller PCHI2.\">\n", &str);
+    if (!strstr(str.s, "##INFO=<ID=PRN,"))
+        kputs("##INFO=<ID=PRN,Number=1,Type=Integer,Description=\"# permutations performed when PR already exceeded the -X fraction of them\">\n", &str);
     if (!strstr(str.s, "##INFO=<ID=QBD,"))
         kputs("##INFO=<ID=QBD,Number=1,Type=Float,Description=\"Quality by Depth: QUAL/#reads\">\n", &str);
     //if (!strstr(str.s, "##INFO=<ID=RPS,"))
@@ -315,16 +315,158 @@ static void write_header(bcf_hdr_t *h)
 
 double bcf_pair_freq(const bcf1_t *b0, const bcf1_t *b1, double f[4]);
 
+int bcf_vc_call1(bcf1_t *b, bcf_p1aux_t *p1, bcf_em_t *em1, double pref, int var_only)
+{
+	extern int bcf_fix_gt(bcf1_t *b);
+	int flag = VC_CALL | VC_EM | VC_CALL_GT | (var_only? VC_VARONLY : 0), calret;
+	double em[10];
+	bcf_p1rst_t pr;
+	if (var_only && strcmp(b->alt, "X") == 0) return 0;
+	// as the loop of bcfview() without -1, -A, -m, -T, -L or -G
+	bcf_gl2pl(b);
+	bcf_em1_r(em1, b, -1, 0x1ff, em);
+	calret = bcf_p1_cal(b, (em[7] >= 0 && em[7] < 1.), p1, &pr);
+	if (pr.p_ref >= pref && var_only) return 0;
+	if (calret >= 0) update_bcf1(b, p1, &pr, pref, flag, em, -1, -1);
+	bcf_fix_gt(b);
+	return 1;
+}
+
+double bcf_vc_ref_qual(const bcf1_t *b, bcf_p1aux_t *p1)
+{
+	bcf_p1rst_t pr;
+	double q;
+	if (bcf_p1_cal(b, 0, p1, &pr) < 0) return 0.;
+	q = pr.p_var < 1e-100? 999 : -4.343 * log(pr.p_var); // as update_bcf1() for !is_var
+	return q > 999? 999 : q;
+}
+
+#define VIEW_BATCH 1024
+#define VIEW_PERM_ROUND 64
+
+typedef struct { // a record waiting for its permutations
+	bcf_p1rst_t pr;
+	bcf_p1aux_t *pa; // copy of the calling state for update_bcf1()
+	double em[10];
+	int calret, cons_llr;
+	int64_t cons_gt;
+} view_perm_t;
+
+typedef struct {
+	const viewconf_t *vc;
+	bcf_p1aux_t **p1; // one per thread; [0] is the caller's
+	bcf_em_t **em; // one per thread
+	int *seeds, *keep; // keep: 0 for dropped, 1 for output and 2 for waiting for permutations
+	bcf1_t **b, **tmp; // tmp: per-thread scratch records for bcf_shuffle()
+	view_perm_t *perm;
+	int perm_i, perm_beg; // the record and the first permutation of the running round
+	uint8_t hit[VIEW_PERM_ROUND];
+} view_batch_t;
+
+// trio/pair calling, EM, variant calling and permutations of one record; no shared state is touched
+static void view_call1(void *data, long i, int tid)
+{
+	extern int bcf_shuffle(bcf1_t *b, int seed);
+	extern int bcf_trio_call(uint32_t *prep, const bcf1_t *b, int *llr, int64_t *gt);
+	extern int bcf_pair_call(const bcf1_t *b);
+	extern gzFile bcf_p1_fp_lk;
+	view_batch_t *w = (view_batch_t*)data;
+	const viewconf_t *vc = w->vc;
+	bcf_p1aux_t *p1 = w->p1[tid];
+	bcf1_t *b = w->b[i];
+	int cons_llr = -1;
+	int64_t cons_gt = -1;
+	double em[10];
+	w->keep[i] = 0;
+	if (vc->trio_aux) // do trio calling
+		bcf_trio_call(vc->trio_aux, b, &cons_llr, &cons_gt);
+	else if (vc->flag & VC_PAIRCALL)
+		cons_llr = bcf_pair_call(b);
+	if (vc->flag & (VC_CALL|VC_ADJLD|VC_EM)) bcf_gl2pl(b);
+	if (vc->flag & VC_EM) bcf_em1_r(w->em[tid], b, vc->n1, 0x1ff, em);
+	else {
+		int i;
+		for (i = 0; i < 9; ++i) em[i] = -1.;
+	}
+	if (!(vc->flag&VC_KEEPALT) && (vc->flag&VC_CALL) && vc->min_ma_lrt>=0) {
+		int gts;
+		bcf_p1_set_ploidy(b, p1); // could be improved: do this per site to allow pseudo-autosomal regions
+		gts = call_multiallelic_gt(b, p1, vc->min_ma_lrt, vc->flag&VC_VARONLY);
+		if (gts <= 1 && vc->flag & VC_VARONLY) return;
+	} else if (vc->flag & VC_CALL) { // call variants
+		bcf_p1rst_t pr;
+		int calret;
+		gzwrite(bcf_p1_fp_lk, &b->tid, 4); // only with a single thread
+		gzwrite(bcf_p1_fp_lk, &b->pos, 4);
+		gzwrite(bcf_p1_fp_lk, &em[0], sizeof(double));
+		calret = bcf_p1_cal(b, (em[7] >= 0 && em[7] < vc->min_lrt), p1, &pr);
+		if (pr.p_ref >= vc->pref && (vc->flag & VC_VARONLY)) return;
+		if (vc->n_perm && vc->n1 > 0 && pr.p_chi2 < vc->min_perm_p) { // permutation test; done by view_perm() over the pool
+			view_perm_t *q = &w->perm[i];
+			q->pr = pr; q->calret = calret; q->cons_llr = cons_llr; q->cons_gt = cons_gt;
+			memcpy(q->em, em, sizeof(double) * 10);
+			q->pa = bcf_p1_dup(p1); // p1 will be overwritten by the following records
+			w->keep[i] = 2;
+			return;
+		}
+		if (calret >= 0) update_bcf1(b, p1, &pr, vc->pref, vc->flag, em, cons_llr, cons_gt);
+	} else if (vc->flag & VC_EM) update_bcf1(b, 0, 0, 0, vc->flag, em, cons_llr, cons_gt);
+	w->keep[i] = 1;
+}
+
+// one permutation of record w->perm_i; the record itself is left untouched
+static void view_perm1(void *data, long j, int tid)
+{
+	extern int bcf_shuffle(bcf1_t *b, int seed);
+	view_batch_t *w = (view_batch_t*)data;
+	view_perm_t *q = &w->perm[w->perm_i];
+	bcf1_t *b = w->tmp[tid];
+	bcf_cpy(b, w->b[w->perm_i]);
+	bcf_shuffle(b, w->seeds[w->perm_beg + j]);
+#ifdef BCF_PERM_LRT // LRT based permutation is much faster but less robust to artifacts
+	{
+		double x[10];
+		bcf_em1_r(w->em[tid], b, w->vc->n1, 1<<7, x);
+		w->hit[j] = (x[7] < q->em[7]);
+	}
+#else
+	{
+		bcf_p1rst_t r;
+		bcf_p1_cal(b, 1, w->p1[tid], &r);
+		w->hit[j] = (q->pr.p_chi2 >= r.p_chi2);
+	}
+#endif
+}
+
+// run the permutations of record i in rounds; stop once PR exceeds the -X fraction, which more permutations cannot undo
+static void view_perm(view_batch_t *w, int i, kt_pool_t *pool)
+{
+	const viewconf_t *vc = w->vc;
+	view_perm_t *q = &w->perm[i];
+	int j, k, n = 0;
+	w->perm_i = i;
+	for (k = 0; k < vc->n_perm;) {
+		int m = vc->n_perm - k < VIEW_PERM_ROUND? vc->n_perm - k : VIEW_PERM_ROUND;
+		w->perm_beg = k;
+		kt_pool_for(pool, view_perm1, w, m);
+		for (j = 0; j < m; ++j) n += w->hit[j];
+		k += m;
+		if (k < vc->n_perm && n > vc->min_perm_p * vc->n_perm) break;
+	}
+	q->pr.perm_rank = n;
+	q->pr.perm_n = k < vc->n_perm? k : 0;
+	if (q->calret >= 0) update_bcf1(w->b[i], q->pa, &q->pr, vc->pref, vc->flag, q->em, q->cons_llr, q->cons_gt);
+	bcf_p1_destroy(q->pa);
+	w->keep[i] = 1;
+}
+
 int bcfview(int argc, char *argv[])
 {
 	extern int bcf_2qcall(bcf_hdr_t *h, bcf1_t *b);
 	extern void bcf_p1_indel_prior(bcf_p1aux_t *ma, double x);
 	extern int bcf_fix_gt(bcf1_t *b);
 	extern int bcf_anno_max(bcf1_t *b);
-	extern int bcf_shuffle(bcf1_t *b, int seed);
 	extern uint32_t *bcf_trio_prep(int is_x, int is_son);
-	extern int bcf_trio_call(uint32_t *prep, const bcf1_t *b, int *llr, int64_t *gt);
-	extern int bcf_pair_call(const bcf1_t *b);
 	extern int bcf_min_diff(const bcf1_t *b);
 	extern int bcf_p1_get_M(bcf_p1aux_t *b);
 
@@ -332,7 +474,9 @@ int bcfview(int argc, char *argv[])
 
 	bcf_t *bp, *bout = 0;
 	bcf1_t *b, *blast;
-	int c, *seeds = 0;
+	int c, *seeds = 0, n_batch, is_eof;
+	view_batch_t w;
+	kt_pool_t *pool;
 	uint64_t n_processed = 0, qcnt[256];
 	viewconf_t vc;
 	bcf_p1aux_t *p1 = 0;
@@ -344,7 +488,7 @@ int bcfview(int argc, char *argv[])
 	memset(&vc, 0, sizeof(viewconf_t));
 	vc.prior_type = vc.n1 = -1; vc.theta = 1e-3; vc.pref = 0.5; vc.indel_frac = -1.; vc.n_perm = 0; vc.min_perm_p = 0.01; vc.min_smpl_frac = 0; vc.min_lrt = 1; vc.min_ma_lrt = -1;
 	memset(qcnt, 0, 8 * 256);
-	while ((c = getopt(argc, argv, "FN1:l:cC:eHAGvbSuP:t:p:QgLi:IMs:D:U:X:d:T:Ywm:K:")) >= 0) {
+	while ((c = getopt(argc, argv, "FN1:l:cC:eHAGvbSuP:t:p:QgLi:IMs:D:U:X:d:T:Ywm:K:@:")) >= 0) {
 		switch (c) {
 		case '1': vc.n1 = atoi(optarg); break;
 		case 'l': vc.bed = bed_read(optarg); if (!vc.bed) { fprintf(stderr,"Could not read \"%s\"\n", optarg); return 1; } break;
@@ -374,6 +518,7 @@ int bcfview(int argc, char *argv[])
 		case 'C': vc.min_lrt = atof(optarg); break;
 		case 'X': vc.min_perm_p = atof(optarg); break;
 		case 'd': vc.min_smpl_frac = atof(optarg); break;
+		case '@': vc.n_threads = atoi(optarg); break;
 		case 'K': bcf_p1_fp_lk = gzopen(optarg, "w"); break;
 		case 's': vc.subsam = read_samples(optarg, &vc.n_sub);
 			vc.ploidy = calloc(vc.n_sub + 1, 1);
@@ -414,6 +559,7 @@ int bcfview(int argc, char *argv[])
 		fprintf(stderr, "       -s FILE   list of samples to use [all samples]\n");
 		fprintf(stderr, "       -S        input is VCF\n");
 		fprintf(stderr, "       -u        uncompressed BCF output (force -b)\n");
+		fprintf(stderr, "       -@ INT    number of calling threads; output order is kept [1]\n");
 		fprintf(stderr, "\nConsensus/variant calling options:\n\n");
 		fprintf(stderr, "       -c        SNP calling (force -e)\n");
 		fprintf(stderr, "       -d FLOAT  skip loci where less than FLOAT fraction of samples covered [0]\n");
@@ -443,11 +589,10 @@ int bcfview(int argc, char *argv[])
 	}
 	if (vc.n1 <= 0) vc.n_perm = 0; // TODO: give a warning here!
 	if (vc.n_perm > 0) {
+		uint64_t x = ks_srand48_r(time(0));
 		seeds = malloc(vc.n_perm * sizeof(int));
-		srand48(time(0));
-		for (c = 0; c < vc.n_perm; ++c) seeds[c] = lrand48();
+		for (c = 0; c < vc.n_perm; ++c) seeds[c] = ks_lrand48_r(&x);
 	}
-	b = calloc(1, sizeof(bcf1_t));
 	blast = calloc(1, sizeof(bcf1_t));
 	strcpy(moder, "r");
 	if (!(vc.flag & VC_VCFIN)) strcat(moder, "b");
@@ -464,7 +609,7 @@ int bcfview(int argc, char *argv[])
 			vc.sublist = calloc(vc.n_sub, sizeof(int));
 			hout = bcf_hdr_subsam(hin, vc.n_sub, vc.subsam, vc.sublist);
 		}
-		write_header(hout); // always print the header
+		bcf_vc_header(hout); // always print the header
 		vcf_hdr_write(bout, hout);
 	}
 	if (vc.flag & VC_CALL) {
@@ -502,118 +647,130 @@ int bcfview(int argc, char *argv[])
 		int32_t M = bcf_p1_get_M(p1);
 		gzwrite(bcf_p1_fp_lk, &M, 4);
 	}
-	while (vcf_read(bp, hin, b) > 0) {
-		int is_indel, cons_llr = -1;
-		int64_t cons_gt = -1;
-		double em[10];
-		if ((vc.flag & VC_VARONLY) && strcmp(b->alt, "X") == 0) continue;
-		if ((vc.flag & VC_VARONLY) && vc.min_smpl_frac > 0.) {
-			extern int bcf_smpl_covered(const bcf1_t *b);
-			int n = bcf_smpl_covered(b);
-			if ((double)n / b->n_smpl < vc.min_smpl_frac) continue;
-		}
-		if (vc.n_sub) bcf_subsam(vc.n_sub, vc.sublist, b);
-		if (vc.flag & VC_FIX_PL) bcf_fix_pl(b);
-		is_indel = bcf_is_indel(b);
-		if ((vc.flag & VC_NO_INDEL) && is_indel) continue;
-		if ((vc.flag & VC_INDEL_ONLY) && !is_indel) continue;
-		if ((vc.flag & VC_ACGT_ONLY) && !is_indel) {
-			int x;
-			if (b->ref[0] == 0 || b->ref[1] != 0) continue;
-			x = toupper(b->ref[0]);
-			if (x != 'A' && x != 'C' && x != 'G' && x != 'T') continue;
-		}
-		if (vc.bed && !bed_overlap(vc.bed, hin->ns[b->tid], b->pos, b->pos + strlen(b->ref))) continue;
-		if (tid >= 0) {
-			int l = strlen(b->ref);
-			l = b->pos + (l > 0? l : 1);
-			if (b->tid != tid || b->pos >= end) break;
-			if (!(l > begin && end > b->pos)) continue;
-		}
-		++n_processed;
-		if ((vc.flag & VC_QCNT) && !is_indel) { // summarize the difference
-			int x = bcf_min_diff(b);
-			if (x > 255) x = 255;
-			if (x >= 0) ++qcnt[x];
-		}
-		if (vc.flag & VC_QCALL) { // output QCALL format; STOP here
-			bcf_2qcall(hout, b);
-			continue;
-		}
-		if (vc.trio_aux) // do trio calling
-			bcf_trio_call(vc.trio_aux, b, &cons_llr, &cons_gt);
-		else if (vc.flag & VC_PAIRCALL)
-			cons_llr = bcf_pair_call(b);
-		if (vc.flag & (VC_CALL|VC_ADJLD|VC_EM)) bcf_gl2pl(b);
-		if (vc.flag & VC_EM) bcf_em1(b, vc.n1, 0x1ff, em);
-		else {
-			int i;
-			for (i = 0; i < 9; ++i) em[i] = -1.;
-		}
-        if ( !(vc.flag&VC_KEEPALT) && (vc.flag&VC_CALL) && vc.min_ma_lrt>=0 )
-        {
-            bcf_p1_set_ploidy(b, p1); // could be improved: do this per site to allow pseudo-autosomal regions
-            int gts = call_multiallelic_gt(b, p1, vc.min_ma_lrt, vc.flag&VC_VARONLY);
-            if ( gts<=1 && vc.flag & VC_VARONLY ) continue;
-        }
-		else if (vc.flag & VC_CALL) { // call variants
-			bcf_p1rst_t pr;
-			int calret;
-			gzwrite(bcf_p1_fp_lk, &b->tid, 4);
-			gzwrite(bcf_p1_fp_lk, &b->pos, 4);
-			gzwrite(bcf_p1_fp_lk, &em[0], sizeof(double));
-			calret = bcf_p1_cal(b, (em[7] >= 0 && em[7] < vc.min_lrt), p1, &pr);
-			if (n_processed % 100000 == 0) {
-				fprintf(stderr, "[%s] %ld sites processed.\n", __func__, (long)n_processed);
-				bcf_p1_dump_afs(p1);
+	if (vc.n_threads > 1 && bcf_p1_fp_lk) {
+		fprintf(stderr, "[%s] -K requires the records in order; -@ is ignored.\n", __func__);
+		vc.n_threads = 1;
+	}
+	if (vc.n_threads < 1) vc.n_threads = 1;
+	// with -@, records are read and written in batches and called in between on the pool
+	n_batch = vc.n_threads > 1? VIEW_BATCH : 1;
+	w.vc = &vc; w.seeds = seeds;
+	w.b = calloc(n_batch, sizeof(void*));
+	w.keep = calloc(n_batch, sizeof(int));
+	w.perm = calloc(n_batch, sizeof(view_perm_t));
+	for (c = 0; c < n_batch; ++c) w.b[c] = calloc(1, sizeof(bcf1_t));
+	w.tmp = calloc(vc.n_threads, sizeof(void*));
+	w.em = calloc(vc.n_threads, sizeof(void*));
+	for (c = 0; c < vc.n_threads; ++c) {
+		w.tmp[c] = calloc(1, sizeof(bcf1_t));
+		w.em[c] = bcf_em_init();
+	}
+	w.p1 = calloc(vc.n_threads, sizeof(void*));
+	w.p1[0] = p1;
+	for (c = 1; c < vc.n_threads && p1; ++c) w.p1[c] = bcf_p1_dup(p1);
+	pool = vc.n_threads > 1? kt_pool_init(vc.n_threads) : 0;
+	for (is_eof = 0; !is_eof;) {
+		int n = 0, is_dump = 0;
+		while (n < n_batch) {
+			int is_indel;
+			b = w.b[n];
+			if (vcf_read(bp, hin, b) <= 0) {
+				is_eof = 1;
+				break;
 			}
-			if (pr.p_ref >= vc.pref && (vc.flag & VC_VARONLY)) continue;
-			if (vc.n_perm && vc.n1 > 0 && pr.p_chi2 < vc.min_perm_p) { // permutation test
-				bcf_p1rst_t r;
-				int i, n = 0;
-				for (i = 0; i < vc.n_perm; ++i) {
-#ifdef BCF_PERM_LRT // LRT based permutation is much faster but less robust to artifacts
-					double x[10];
-					bcf_shuffle(b, seeds[i]);
-					bcf_em1(b, vc.n1, 1<<7, x);
-					if (x[7] < em[7]) ++n;
-#else
-					bcf_shuffle(b, seeds[i]);
-					bcf_p1_cal(b, 1, p1, &r);
-					if (pr.p_chi2 >= r.p_chi2) ++n;
-#endif
+			if ((vc.flag & VC_VARONLY) && strcmp(b->alt, "X") == 0) continue;
+			if ((vc.flag & VC_VARONLY) && vc.min_smpl_frac > 0.) {
+				extern int bcf_smpl_covered(const bcf1_t *b);
+				int n = bcf_smpl_covered(b);
+				if ((double)n / b->n_smpl < vc.min_smpl_frac) continue;
+			}
+			if (vc.n_sub) bcf_subsam(vc.n_sub, vc.sublist, b);
+			if (vc.flag & VC_FIX_PL) bcf_fix_pl(b);
+			is_indel = bcf_is_indel(b);
+			if ((vc.flag & VC_NO_INDEL) && is_indel) continue;
+			if ((vc.flag & VC_INDEL_ONLY) && !is_indel) continue;
+			if ((vc.flag & VC_ACGT_ONLY) && !is_indel) {
+				int x;
+				if (b->ref[0] == 0 || b->ref[1] != 0) continue;
+				x = toupper(b->ref[0]);
+				if (x != 'A' && x != 'C' && x != 'G' && x != 'T') continue;
+			}
+			if (vc.bed && !bed_overlap(vc.bed, hin->ns[b->tid], b->pos, b->pos + strlen(b->ref))) continue;
+			if (tid >= 0) {
+				int l = strlen(b->ref);
+				l = b->pos + (l > 0? l : 1);
+				if (b->tid != tid || b->pos >= end) {
+					is_eof = 1;
+					break;
 				}
-				pr.perm_rank = n;
+				if (!(l > begin && end > b->pos)) continue;
+			}
+			++n_processed;
+			if ((vc.flag & VC_QCNT) && !is_indel) { // summarize the difference
+				int x = bcf_min_diff(b);
+				if (x > 255) x = 255;
+				if (x >= 0) ++qcnt[x];
 			}
-			if (calret >= 0) update_bcf1(b, p1, &pr, vc.pref, vc.flag, em, cons_llr, cons_gt);
-		} else if (vc.flag & VC_EM) update_bcf1(b, 0, 0, 0, vc.flag, em, cons_llr, cons_gt);
-		if (vc.flag & VC_ADJLD) { // compute LD
-			double f[4], r2;
-			if ((r2 = bcf_pair_freq(blast, b, f)) >= 0) {
-				kstring_t s;
-				s.m = s.l = 0; s.s = 0;
-				if (*b->info) kputc(';', &s);
-				ksprintf(&s, "NEIR=%.3f;NEIF4=%.3f,%.3f,%.3f,%.3f", r2, f[0], f[1], f[2], f[3]);
-				bcf_append_info(b, s.s, s.l);
-				free(s.s);
+			if (vc.flag & VC_QCALL) { // output QCALL format; STOP here
+				bcf_2qcall(hout, b);
+				continue;
 			}
-			bcf_cpy(blast, b);
+			++n;
+			if (n_processed % 100000 == 0) { // the AFS is printed after this record
+				is_dump = !(!(vc.flag&VC_KEEPALT) && (vc.flag&VC_CALL) && vc.min_ma_lrt>=0) && (vc.flag & VC_CALL);
+				break;
+			}
+		}
+		kt_pool_for(pool, view_call1, &w, n);
+		for (c = 0; c < n; ++c)
+			if (w.keep[c] == 2) view_perm(&w, c, pool);
+		for (c = 0; c < n; ++c) {
+			if (!w.keep[c]) continue;
+			b = w.b[c];
+			if (vc.flag & VC_ADJLD) { // compute LD
+				double f[4], r2;
+				if ((r2 = bcf_pair_freq(blast, b, f)) >= 0) {
+					kstring_t s;
+					s.m = s.l = 0; s.s = 0;
+					if (*b->info) kputc(';', &s);
+					ksprintf(&s, "NEIR=%.3f;NEIF4=%.3f,%.3f,%.3f,%.3f", r2, f[0], f[1], f[2], f[3]);
+					bcf_append_info(b, s.s, s.l);
+					free(s.s);
+				}
+				bcf_cpy(blast, b);
+			}
+			if (vc.flag & VC_ANNO_MAX) bcf_anno_max(b);
+			if (vc.flag & VC_NO_GENO) { // do not output GENO fields
+				b->n_gi = 0;
+				b->fmt[0] = '\0';
+				b->l_str = b->fmt - b->str + 1;
+			} else bcf_fix_gt(b);
+			vcf_write(bout, hout, b);
 		}
-		if (vc.flag & VC_ANNO_MAX) bcf_anno_max(b);
-		if (vc.flag & VC_NO_GENO) { // do not output GENO fields
-			b->n_gi = 0;
-			b->fmt[0] = '\0';
-			b->l_str = b->fmt - b->str + 1;
-		} else bcf_fix_gt(b);
-		vcf_write(bout, hout, b);
+		if (is_dump) {
+			for (c = 1; c < vc.n_threads; ++c) bcf_p1_merge_afs(p1, w.p1[c]);
+			fprintf(stderr, "[%s] %ld sites processed.\n", __func__, (long)n_processed);
+			bcf_p1_dump_afs(p1);
+		}
+	}
+	kt_pool_destroy(pool);
+	for (c = 1; c < vc.n_threads && p1; ++c) {
+		bcf_p1_merge_afs(p1, w.p1[c]);
+		bcf_p1_destroy(w.p1[c]);
+	}
+	for (c = 0; c < n_batch; ++c) bcf_destroy(w.b[c]);
+	for (c = 0; c < vc.n_threads; ++c) {
+		bcf_destroy(w.tmp[c]);
+		bcf_em_destroy(w.em[c]);
 	}
+	free(w.b); free(w.tmp); free(w.em); free(w.keep); free(w.perm); free(w.p1);
 
 	if (bcf_p1_fp_lk) gzclose(bcf_p1_fp_lk);
 	if (vc.prior_file) free(vc.prior_file);
 	if (vc.flag & VC_CALL) bcf_p1_dump_afs(p1);
 	if (hin != hout) bcf_hdr_destroy(hout);
 	bcf_hdr_destroy(hin);
-	bcf_destroy(b); bcf_destroy(blast);
+	bcf_destroy(blast);
 	vcf_close(bp); vcf_close(bout);
 	if (vc.fn_dict) free(vc.fn_dict);
 	if (vc.ploidy) free(vc.ploidy);
@@ -1,10 +1,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include "bcf.h"
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "prob1.h"
 #include "kmin.h"
+#include "kstring.h"
 
 static double g_q2p[256];
+static pthread_once_t g_q2p_once = PTHREAD_ONCE_INIT;
+
+static void init_q2p(void)
+{
+	int i;
+	for (i = 0; i < 256; ++i)
+		g_q2p[i] = pow(10., -i / 10.);
+}
 
 #define ITER_MAX 50
 #define ITER_TRY 10
@@ -12,28 +25,46 @@ static double g_q2p[256];
 
 extern double kf_gammaq(double, double);
 
+struct __bcf_em_t {
+	int m;
+	double *p[3]; // genotype likelihoods, one array per genotype so that the EM loops run across samples
+};
+
+bcf_em_t *bcf_em_init(void)
+{
+	return calloc(1, sizeof(bcf_em_t));
+}
+
+void bcf_em_destroy(bcf_em_t *em)
+{
+	if (em == 0) return;
+	free(em->p[0]);
+	free(em);
+}
+
 /*
 	Generic routines
  */
+// find the PL field
+static const uint8_t *get_PL(const bcf1_t *b, int *PL_len)
+{
+	int i;
+	pthread_once(&g_q2p_once, init_q2p); // callers may run in several threads
+	for (i = 0; i < b->n_gi; ++i)
+		if (b->gi[i].fmt == bcf_str2int("PL", 2)) {
+			*PL_len = b->gi[i].len;
+			return (const uint8_t*)b->gi[i].data;
+		}
+	return 0;
+}
+
 // get the 3 genotype likelihoods
 static double *get_pdg3(const bcf1_t *b)
 {
 	double *pdg;
-	const uint8_t *PL = 0;
-	int i, PL_len = 0;
-	// initialize g_q2p if necessary
-	if (g_q2p[0] == 0.)
-		for (i = 0; i < 256; ++i)
-			g_q2p[i] = pow(10., -i / 10.);
-	// set PL and PL_len
-	for (i = 0; i < b->n_gi; ++i) {
-		if (b->gi[i].fmt == bcf_str2int("PL", 2)) {
-			PL = (const uint8_t*)b->gi[i].data;
-			PL_len = b->gi[i].len;
-			break;
-		}
-	}
-	if (i == b->n_gi) return 0; // no PL
+	const uint8_t *PL;
+	int i, PL_len;
+	if ((PL = get_PL(b, &PL_len)) == 0) return 0; // no PL
 	// fill pdg
 	pdg = malloc(3 * b->n_smpl * sizeof(double));
 	for (i = 0; i < b->n_smpl; ++i) {
@@ -44,6 +75,26 @@ static double *get_pdg3(const bcf1_t *b)
 	return pdg;
 }
 
+// as get_pdg3() but into the buffers of em
+static int get_pdg3_r(bcf_em_t *em, const bcf1_t *b)
+{
+	const uint8_t *PL;
+	int i, PL_len;
+	double *p0, *p1, *p2;
+	if ((PL = get_PL(b, &PL_len)) == 0) return -1;
+	if (b->n_smpl > em->m) {
+		em->m = b->n_smpl;
+		kroundup32(em->m);
+		free(em->p[0]);
+		em->p[0] = malloc(3 * em->m * sizeof(double));
+		em->p[1] = em->p[0] + em->m; em->p[2] = em->p[1] + em->m;
+	}
+	p0 = em->p[0]; p1 = em->p[1]; p2 = em->p[2];
+	for (i = 0; i < b->n_smpl; ++i, PL += PL_len)
+		p0[i] = g_q2p[PL[2]], p1[i] = g_q2p[PL[1]], p2[i] = g_q2p[PL[0]];
+	return 0;
+}
+
 // estimate site allele frequency in a very naive and inaccurate way
 static double est_freq(int n, const double *pdg)
 {
@@ -62,43 +113,71 @@ static double est_freq(int n, const double *pdg)
 	return (tmp1 == 0)? -1.0 : (.5 * gcnt[1] + gcnt[2]) / tmp1;
 }
 
+static double est_freq_r(int n, double *const p[3])
+{
+	int i, gcnt[3], tmp1;
+	gcnt[0] = gcnt[1] = gcnt[2] = 0;
+	for (i = 0; i < n; ++i) {
+		if (p[0][i] != 1. || p[1][i] != 1. || p[2][i] != 1.) {
+			int which = p[0][i] > p[1][i]? 0 : 1;
+			which = p[which][i] > p[2][i]? which : 2;
+			++gcnt[which];
+		}
+	}
+	tmp1 = gcnt[0] + gcnt[1] + gcnt[2];
+	return (tmp1 == 0)? -1.0 : (.5 * gcnt[1] + gcnt[2]) / tmp1;
+}
+
 /*
 	Single-locus EM
  */
 
 typedef struct {
 	int beg, end;
-	const double *pdg;
+	double *const *p;
 } minaux1_t;
 
 static double prob1(double f, void *data)
 {
 	minaux1_t *a = (minaux1_t*)data;
+	const double *p0 = a->p[0], *p1 = a->p[1], *p2 = a->p[2];
 	double p = 1., l = 0., f3[3];
 	int i;
 //	printf("brent %lg\n", f);
 	if (f < 0 || f > 1) return 1e300;
 	f3[0] = (1.-f)*(1.-f); f3[1] = 2.*f*(1.-f); f3[2] = f*f;
 	for (i = a->beg; i < a->end; ++i) {
-		const double *pdg = a->pdg + i * 3;
-		p *= pdg[0] * f3[0] + pdg[1] * f3[1] + pdg[2] * f3[2];
+		p *= p0[i] * f3[0] + p1[i] * f3[1] + p2[i] * f3[2];
 		if (p < 1e-200) l -= log(p), p = 1.;
 	}
 	return l - log(p);
 }
 
 // one EM iteration for allele frequency estimate
-static double freq_iter(double *f, const double *_pdg, int beg, int end)
+static double freq_iter(double *f, double *const p[3], int beg, int end)
 {
+	const double *p0 = p[0], *p1 = p[1], *p2 = p[2];
 	double f0 = *f, f3[3], err;
-	int i;
+	int i = beg;
 //	printf("em %lg\n", *f);
 	f3[0] = (1.-f0)*(1.-f0); f3[1] = 2.*f0*(1.-f0); f3[2] = f0*f0;
-	for (i = beg, f0 = 0.; i < end; ++i) {
-		const double *pdg = _pdg + i * 3;
-		f0 += (pdg[1] * f3[1] + 2. * pdg[2] * f3[2])
-			/ (pdg[0] * f3[0] + pdg[1] * f3[1] + pdg[2] * f3[2]);
+	f0 = 0.;
+#ifdef __SSE2__
+	if (end - i >= 2) { // two samples at a time
+		__m128d s = _mm_setzero_pd(), g0 = _mm_set1_pd(f3[0]), g1 = _mm_set1_pd(f3[1]), g2 = _mm_set1_pd(2. * f3[2]), h2 = _mm_set1_pd(f3[2]);
+		double t[2];
+		for (; i + 1 < end; i += 2) {
+			__m128d x0 = _mm_loadu_pd(p0 + i), x1 = _mm_mul_pd(_mm_loadu_pd(p1 + i), g1), x2 = _mm_loadu_pd(p2 + i);
+			__m128d num = _mm_add_pd(x1, _mm_mul_pd(x2, g2));
+			__m128d den = _mm_add_pd(_mm_add_pd(_mm_mul_pd(x0, g0), x1), _mm_mul_pd(x2, h2));
+			s = _mm_add_pd(s, _mm_div_pd(num, den));
+		}
+		_mm_storeu_pd(t, s);
+		f0 = t[0] + t[1];
 	}
+#endif
+	for (; i < end; ++i)
+		f0 += (p1[i] * f3[1] + 2. * p2[i] * f3[2]) / (p0[i] * f3[0] + p1[i] * f3[1] + p2[i] * f3[2]);
 	f0 /= (end - beg) * 2;
 	err = fabs(f0 - *f);
 	*f = f0;
@@ -110,33 +189,49 @@ static double freq_iter(double *f, const double *_pdg, int beg, int end)
  * When this happens, we switch to Brent's method. The idea is learned from
  * Rasmus Nielsen.
  */
-static double freqml(double f0, int beg, int end, const double *pdg)
+static double freqml(double f0, int beg, int end, double *const p[3])
 {
 	int i;
 	double f;
 	for (i = 0, f = f0; i < ITER_TRY; ++i)
-		if (freq_iter(&f, pdg, beg, end) < EPS) break;
+		if (freq_iter(&f, p, beg, end) < EPS) break;
 	if (i == ITER_TRY) { // haven't converged yet; try Brent's method
 		minaux1_t a;
-		a.beg = beg; a.end = end; a.pdg = pdg;
+		a.beg = beg; a.end = end; a.p = p;
 		kmin_brent(prob1, f0 == f? .5*f0 : f0, f, (void*)&a, EPS, &f);
 	}
 	return f;
 }
 
 // one EM iteration for genotype frequency estimate
-static double g3_iter(double g[3], const double *_pdg, int beg, int end)
+static double g3_iter(double g[3], double *const p[3], int beg, int end)
 {
-	double err, gg[3];
-	int i;
+	const double *p0 = p[0], *p1 = p[1], *p2 = p[2];
+	double err, gg[3], r = 1. / (end - beg);
+	int i = beg;
 	gg[0] = gg[1] = gg[2] = 0.;
 //	printf("%lg,%lg,%lg\n", g[0], g[1], g[2]);
-	for (i = beg; i < end; ++i) {
-		double sum, tmp[3];
-		const double *pdg = _pdg + i * 3;
-		tmp[0] = pdg[0] * g[0]; tmp[1] = pdg[1] * g[1]; tmp[2] = pdg[2] * g[2];
-		sum = (tmp[0] + tmp[1] + tmp[2]) * (end - beg);
-		gg[0] += tmp[0] / sum; gg[1] += tmp[1] / sum; gg[2] += tmp[2] / sum;
+#ifdef __SSE2__
+	if (end - i >= 2) {
+		__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd(), s2 = _mm_setzero_pd();
+		__m128d g0 = _mm_set1_pd(g[0]), g1 = _mm_set1_pd(g[1]), g2 = _mm_set1_pd(g[2]), rr = _mm_set1_pd(r);
+		double t[3][2];
+		for (; i + 1 < end; i += 2) {
+			__m128d t0 = _mm_mul_pd(_mm_loadu_pd(p0 + i), g0), t1 = _mm_mul_pd(_mm_loadu_pd(p1 + i), g1), t2 = _mm_mul_pd(_mm_loadu_pd(p2 + i), g2);
+			__m128d w = _mm_div_pd(rr, _mm_add_pd(_mm_add_pd(t0, t1), t2));
+			s0 = _mm_add_pd(s0, _mm_mul_pd(t0, w));
+			s1 = _mm_add_pd(s1, _mm_mul_pd(t1, w));
+			s2 = _mm_add_pd(s2, _mm_mul_pd(t2, w));
+		}
+		_mm_storeu_pd(t[0], s0); _mm_storeu_pd(t[1], s1); _mm_storeu_pd(t[2], s2);
+		gg[0] = t[0][0] + t[0][1]; gg[1] = t[1][0] + t[1][1]; gg[2] = t[2][0] + t[2][1];
+	}
+#endif
+	for (; i < end; ++i) {
+		double w, tmp[3];
+		tmp[0] = p0[i] * g[0]; tmp[1] = p1[i] * g[1]; tmp[2] = p2[i] * g[2];
+		w = r / (tmp[0] + tmp[1] + tmp[2]);
+		gg[0] += tmp[0] * w; gg[1] += tmp[1] * w; gg[2] += tmp[2] * w;
 	}
 	err = fabs(gg[0] - g[0]) > fabs(gg[1] - g[1])? fabs(gg[0] - g[0]) : fabs(gg[1] - g[1]);
 	err = err > fabs(gg[2] - g[2])? err : fabs(gg[2] - g[2]);
@@ -145,20 +240,17 @@ static double g3_iter(double g[3], const double *_pdg, int beg, int end)
 }
 
 // perform likelihood ratio test
-static double lk_ratio_test(int n, int n1, const double *pdg, double f3[3][3])
+static double lk_ratio_test(int n, int n1, double *const p[3], double f3[3][3])
 {
+	const double *p0 = p[0], *p1 = p[1], *p2 = p[2];
 	double r;
 	int i;
-	for (i = 0, r = 1.; i < n1; ++i) {
-		const double *p = pdg + i * 3;
-		r *= (p[0] * f3[1][0] + p[1] * f3[1][1] + p[2] * f3[1][2])
-			/ (p[0] * f3[0][0] + p[1] * f3[0][1] + p[2] * f3[0][2]);
-	}
-	for (; i < n; ++i) {
-		const double *p = pdg + i * 3;
-		r *= (p[0] * f3[2][0] + p[1] * f3[2][1] + p[2] * f3[2][2])
-			/ (p[0] * f3[0][0] + p[1] * f3[0][1] + p[2] * f3[0][2]);
-	}
+	for (i = 0, r = 1.; i < n1; ++i)
+		r *= (p0[i] * f3[1][0] + p1[i] * f3[1][1] + p2[i] * f3[1][2])
+			/ (p0[i] * f3[0][0] + p1[i] * f3[0][1] + p2[i] * f3[0][2]);
+	for (; i < n; ++i)
+		r *= (p0[i] * f3[2][0] + p1[i] * f3[2][1] + p2[i] * f3[2][2])
+			/ (p0[i] * f3[0][0] + p1[i] * f3[0][1] + p2[i] * f3[0][2]);
 	return r;
 }
 
@@ -168,9 +260,9 @@ static double lk_ratio_test(int n, int n1, const double *pdg, double f3[3][3])
 // x[5..6]: group1 freq, group2 freq
 // x[7]: 1-degree P-value
 // x[8]: 2-degree P-value
-int bcf_em1(const bcf1_t *b, int n1, int flag, double x[10])
+int bcf_em1_r(bcf_em_t *em, const bcf1_t *b, int n1, int flag, double x[10])
 {
-	double *pdg;
+	double *const *pdg = em->p;
 	int i, n, n2;
 	if (b->n_alleles < 2) return -1; // one allele only
 	// initialization
@@ -178,14 +270,10 @@ int bcf_em1(const bcf1_t *b, int n1, int flag, double x[10])
 	if (flag & 1<<7) flag |= 7<<5; // compute group freq if LRT is required
 	if (flag & 0xf<<1) flag |= 0xf<<1;
 	n = b->n_smpl; n2 = n - n1;
-	pdg = get_pdg3(b);
-	if (pdg == 0) return -1;
+	if (get_pdg3_r(em, b) < 0) return -1;
 	for (i = 0; i < 10; ++i) x[i] = -1.; // set to negative
 	{
-		if ((x[0] = est_freq(n, pdg)) < 0.) {
-			free(pdg);
-			return -1; // no data
-		}
+		if ((x[0] = est_freq_r(n, pdg)) < 0.) return -1; // no data
 		x[0] = freqml(x[0], 0, n, pdg);
 	}
 	if (flag & (0xf<<1|3<<8)) { // estimate the genotype frequency and test HWE
@@ -196,10 +284,8 @@ int bcf_em1(const bcf1_t *b, int n1, int flag, double x[10])
 		for (i = 0; i < ITER_MAX; ++i)
 			if (g3_iter(g, pdg, 0, n) < EPS) break;
 		// Hardy-Weinberg equilibrium (HWE)
-		for (i = 0, r = 1.; i < n; ++i) {
-			double *p = pdg + i * 3;
-			r *= (p[0] * g[0] + p[1] * g[1] + p[2] * g[2]) / (p[0] * f3[0] + p[1] * f3[1] + p[2] * f3[2]);
-		}
+		for (i = 0, r = 1.; i < n; ++i)
+			r *= (pdg[0][i] * g[0] + pdg[1][i] * g[1] + pdg[2][i] * g[2]) / (pdg[0][i] * f3[0] + pdg[1][i] * f3[1] + pdg[2][i] * f3[2]);
 		x[4] = kf_gammaq(.5, log(r));
 	}
 	if ((flag & 7<<5) && n1 > 0 && n1 < n) { // group frequency
@@ -226,11 +312,19 @@ int bcf_em1(const bcf1_t *b, int n1, int flag, double x[10])
 		if (tmp < 0) tmp = 0;
 		x[8] = kf_gammaq(1., tmp);
 	}
-	// free
-	free(pdg);
 	return 0;
 }
 
+int bcf_em1(const bcf1_t *b, int n1, int flag, double x[10])
+{
+	bcf_em_t em;
+	int ret;
+	memset(&em, 0, sizeof(bcf_em_t));
+	ret = bcf_em1_r(&em, b, n1, flag, x);
+	free(em.p[0]);
+	return ret;
+}
+
 /*
 	Two-locus EM (LD)
  */
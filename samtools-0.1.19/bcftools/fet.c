@@ -1,16 +1,34 @@
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
 
 /* This program is implemented with ideas from this web page:
  *
  *   http://www.langsrud.com/fisher.htm
  */
 
+#define FET_N_LF 16384
+
+static double fet_lf[FET_N_LF]; // log(i!), read-only once set
+static pthread_once_t fet_lf_once = PTHREAD_ONCE_INIT;
+
+static void fet_lf_init(void)
+{
+	int i;
+	for (i = 0; i < FET_N_LF; ++i) fet_lf[i] = lgamma(i+1);
+}
+
+static inline double lfact(int n)
+{
+	return n < FET_N_LF? fet_lf[n] : lgamma(n+1);
+}
+
 // log\binom{n}{k}
 static double lbinom(int n, int k)
 {
 	if (k == 0 || n == k) return 0;
-	return lgamma(n+1) - lgamma(k+1) - lgamma(n-k+1);
+	return lfact(n) - lfact(k) - lfact(n-k);
 }
 
 // n11  n12  | n1_
@@ -62,6 +80,7 @@ double kt_fisher_exact(int n11, int n12, int n21, int n22, double *_left, double
 	hgacc_t aux;
 	int n1_, n_1, n;
 
+	pthread_once(&fet_lf_once, fet_lf_init);
 	n1_ = n11 + n12; n_1 = n11 + n21; n = n11 + n12 + n21 + n22; // calculate n1_, n_1 and n
 	max = (n_1 < n1_) ? n_1 : n1_; // max n11, for right tail
 	min = n1_ + n_1 - n;
@@ -93,6 +112,52 @@ double kt_fisher_exact(int n11, int n12, int n21, int n22, double *_left, double
 	return q;
 }
 
+/* Memoized kt_fisher_exact() for tables with fewer than FET_CACHE_MAX_N
+ * reads, such as the per-sample strand tables of SP. The cache is direct
+ * mapped and must not be shared among threads. */
+
+#define FET_CACHE_BITS 10
+#define FET_CACHE_MAX_N 256
+
+typedef struct {
+	uint32_t key; // n11|n12<<8|n21<<16|n22<<24
+	double q, left, right, two;
+} fet_entry_t;
+
+typedef struct __kt_fet_cache_t {
+	fet_entry_t a[1<<FET_CACHE_BITS];
+} kt_fet_cache_t;
+
+kt_fet_cache_t *kt_fet_cache_init(void)
+{
+	kt_fet_cache_t *c;
+	int i;
+	c = malloc(sizeof(kt_fet_cache_t));
+	for (i = 0; i < 1<<FET_CACHE_BITS; ++i) c->a[i].key = UINT32_MAX; // not a valid key as n < 256
+	return c;
+}
+
+void kt_fet_cache_destroy(kt_fet_cache_t *c)
+{
+	free(c);
+}
+
+double kt_fisher_exact_r(kt_fet_cache_t *c, int n11, int n12, int n21, int n22, double *_left, double *_right, double *two)
+{
+	uint32_t key;
+	fet_entry_t *e;
+	if (c == 0 || n11 < 0 || n12 < 0 || n21 < 0 || n22 < 0 || n11 + n12 + n21 + n22 >= FET_CACHE_MAX_N)
+		return kt_fisher_exact(n11, n12, n21, n22, _left, _right, two);
+	key = (uint32_t)n11 | (uint32_t)n12<<8 | (uint32_t)n21<<16 | (uint32_t)n22<<24;
+	e = &c->a[(key * 2654435769U) >> (32 - FET_CACHE_BITS)];
+	if (e->key != key) {
+		e->q = kt_fisher_exact(n11, n12, n21, n22, &e->left, &e->right, &e->two);
+		e->key = key;
+	}
+	*_left = e->left; *_right = e->right; *two = e->two;
+	return e->q;
+}
+
 #ifdef FET_MAIN
 #include <stdio.h>
 
@@ -6,6 +6,14 @@
 #include <assert.h>
 #include <limits.h>
 #include <zlib.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MC_AVX2
+#include <immintrin.h>
+#endif
 #include "prob1.h"
 #include "kstring.h"
 
@@ -168,6 +176,39 @@ bcf_p1aux_t *bcf_p1_init(int n, uint8_t *ploidy)
 	return ma;
 }
 
+#define p1_dup_array(x, n) ((x)? memcpy(malloc((n) * sizeof(*(x))), (x), (n) * sizeof(*(x))) : 0)
+
+bcf_p1aux_t *bcf_p1_dup(const bcf_p1aux_t *ma)
+{
+	bcf_p1aux_t *p;
+	p = malloc(sizeof(bcf_p1aux_t));
+	*p = *ma;
+	p->ploidy = p1_dup_array(ma->ploidy, ma->n);
+	p->q2p = p1_dup_array(ma->q2p, 256);
+	p->pdg = p1_dup_array(ma->pdg, 3 * ma->n);
+	p->phi = p1_dup_array(ma->phi, ma->M + 1);
+	p->phi_indel = p1_dup_array(ma->phi_indel, ma->M + 1);
+	p->phi1 = p1_dup_array(ma->phi1, ma->M + 1);
+	p->phi2 = p1_dup_array(ma->phi2, ma->M + 1);
+	p->z = p1_dup_array(ma->z, ma->M + 1);
+	p->zswap = p1_dup_array(ma->zswap, ma->M + 1);
+	p->z1 = p1_dup_array(ma->z1, ma->M + 1);
+	p->z2 = p1_dup_array(ma->z2, ma->M + 1);
+	p->afs = calloc(ma->M + 1, sizeof(double));
+	p->afs1 = calloc(ma->M + 1, sizeof(double));
+	p->lf = p1_dup_array(ma->lf, ma->M + 1);
+	p->hg = 0; // computed on demand
+	p->PL = 0;
+	return p;
+}
+
+void bcf_p1_merge_afs(bcf_p1aux_t *ma, bcf_p1aux_t *src)
+{
+	int k;
+	for (k = 0; k <= ma->M; ++k) ma->afs[k] += src->afs[k];
+	memset(src->afs, 0, sizeof(double) * (src->M + 1));
+}
+
 int bcf_p1_get_M(bcf_p1aux_t *b) { return b->M; }
 
 int bcf_p1_set_n1(bcf_p1aux_t *b, int n1)
@@ -671,88 +712,138 @@ int bcf_p1_call_gt(const bcf_p1aux_t *ma, double f0, int k)
 
 #define TINY 1e-20
 
+/* One sample of the recursion over the allele count k in [_min,_max]:
+ *   z1[k] = C(M0-k+2,2) p0 z0[k] + k(M0-k+2) p1 z0[k-1] + C(k,2) p2 z0[k-2]    (diploid; binomials times 2)
+ *   z1[k] = (M0-k+1) p0 z0[k] + k p1 z0[k-1]                                   (haploid)
+ * z0 is left unnormalized by the previous step; its 1/sum is folded into p[]. Returns the sum of z1[]. */
+static double mc_cal_y_step2(const double *z0, double *z1, int M0, int _min, int _max, const double p[3])
+{
+	int k = _min;
+	double sum = 0.;
+	if (k == 0) sum += (z1[0] = (double)(M0+1) * (M0+2) * p[0] * z0[0]), ++k;
+	if (k == 1) sum += (z1[1] = (double)M0 * (M0+1) * p[0] * z0[1] + (double)(M0+1) * p[1] * z0[0]), ++k;
+#ifdef __SSE2__
+	if (k < _max) { // two k at a time; the integer coefficients are exact in double
+		__m128d s2 = _mm_setzero_pd(), kv = _mm_set_pd(k + 1, k), one = _mm_set1_pd(1.), two = _mm_set1_pd(2.);
+		__m128d m1 = _mm_set1_pd(M0 + 1), m2 = _mm_set1_pd(M0 + 2);
+		__m128d p0 = _mm_set1_pd(p[0]), p1 = _mm_set1_pd(p[1]), p2 = _mm_set1_pd(p[2]);
+		double s[2];
+		for (; k < _max; k += 2, kv = _mm_add_pd(kv, two)) {
+			__m128d b = _mm_sub_pd(m2, kv), x;
+			x = _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(_mm_sub_pd(m1, kv), b), p0), _mm_loadu_pd(z0 + k));
+			x = _mm_add_pd(x, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(kv, b), p1), _mm_loadu_pd(z0 + k - 1)));
+			x = _mm_add_pd(x, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(kv, _mm_sub_pd(kv, one)), p2), _mm_loadu_pd(z0 + k - 2)));
+			_mm_storeu_pd(z1 + k, x);
+			s2 = _mm_add_pd(s2, x);
+		}
+		_mm_storeu_pd(s, s2);
+		sum += s[0] + s[1];
+	}
+#endif
+	for (; k <= _max; ++k)
+		sum += (z1[k] = (double)(M0-k+1) * (M0-k+2) * p[0] * z0[k] + (double)k * (M0-k+2) * p[1] * z0[k-1] + (double)k * (k-1) * p[2] * z0[k-2]);
+	return sum;
+}
+
+#ifdef MC_AVX2
+__attribute__((target("avx2")))
+static double mc_cal_y_step2_avx2(const double *z0, double *z1, int M0, int _min, int _max, const double p[3])
+{
+	int k = _min;
+	double sum = 0.;
+	if (k == 0) sum += (z1[0] = (double)(M0+1) * (M0+2) * p[0] * z0[0]), ++k;
+	if (k == 1) sum += (z1[1] = (double)M0 * (M0+1) * p[0] * z0[1] + (double)(M0+1) * p[1] * z0[0]), ++k;
+	if (k + 3 <= _max) { // four k at a time; as mc_cal_y_step2() otherwise
+		__m256d s4 = _mm256_setzero_pd(), kv = _mm256_set_pd(k + 3, k + 2, k + 1, k), one = _mm256_set1_pd(1.), four = _mm256_set1_pd(4.);
+		__m256d m1 = _mm256_set1_pd(M0 + 1), m2 = _mm256_set1_pd(M0 + 2);
+		__m256d p0 = _mm256_set1_pd(p[0]), p1 = _mm256_set1_pd(p[1]), p2 = _mm256_set1_pd(p[2]);
+		double s[4];
+		for (; k + 3 <= _max; k += 4, kv = _mm256_add_pd(kv, four)) {
+			__m256d b = _mm256_sub_pd(m2, kv), x;
+			x = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_sub_pd(m1, kv), b), p0), _mm256_loadu_pd(z0 + k));
+			x = _mm256_add_pd(x, _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(kv, b), p1), _mm256_loadu_pd(z0 + k - 1)));
+			x = _mm256_add_pd(x, _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(kv, _mm256_sub_pd(kv, one)), p2), _mm256_loadu_pd(z0 + k - 2)));
+			_mm256_storeu_pd(z1 + k, x);
+			s4 = _mm256_add_pd(s4, x);
+		}
+		_mm256_storeu_pd(s, s4);
+		sum += (s[0] + s[1]) + (s[2] + s[3]);
+	}
+	for (; k <= _max; ++k)
+		sum += (z1[k] = (double)(M0-k+1) * (M0-k+2) * p[0] * z0[k] + (double)k * (M0-k+2) * p[1] * z0[k-1] + (double)k * (k-1) * p[2] * z0[k-2]);
+	return sum;
+}
+#endif
+
+typedef double (*mc_step2_f)(const double*, double*, int, int, int, const double*);
+
+static mc_step2_f g_mc_step2;
+static pthread_once_t g_mc_once = PTHREAD_ONCE_INIT;
+
+static void mc_init(void)
+{
+	mc_step2_f f = mc_cal_y_step2; // SSE2 where the compiler targets it, scalar otherwise
+#ifdef MC_AVX2
+	if (__builtin_cpu_supports("avx2")) f = mc_cal_y_step2_avx2;
+#endif
+	g_mc_step2 = f;
+}
+
+static double mc_cal_y_step1(const double *z0, double *z1, int M0, int _min, int _max, const double p[2])
+{
+	int k = _min;
+	double sum = 0.;
+	if (k == 0) sum += (z1[0] = (double)(M0+1) * p[0] * z0[0]), ++k;
+	for (; k <= _max; ++k)
+		sum += (z1[k] = (double)(M0+1-k) * p[0] * z0[k] + (double)k * p[1] * z0[k-1]);
+	return sum;
+}
+
 static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
 {
-	double *z[2], *tmp, *pdg;
-	int _j, last_min, last_max;
+	double *z[2], *tmp, *pdg, sum = 1.;
+	int _j, k, last_min, last_max, M = 0;
 	assert(beg == 0 || ma->M == ma->n*2);
+	pthread_once(&g_mc_once, mc_init);
 	z[0] = ma->z;
 	z[1] = ma->zswap;
-	pdg = ma->pdg;
 	memset(z[0], 0, sizeof(double) * (ma->M + 1));
 	memset(z[1], 0, sizeof(double) * (ma->M + 1));
 	z[0][0] = 1.;
 	last_min = last_max = 0;
 	ma->t = 0.;
-	if (ma->M == ma->n * 2) {
-		int M = 0;
-		for (_j = beg; _j < ma->n; ++_j) {
-			int k, j = _j - beg, _min = last_min, _max = last_max, M0;
-			double p[3], sum;
-			M0 = M; M += 2;
-			pdg = ma->pdg + _j * 3;
-			p[0] = pdg[0]; p[1] = 2. * pdg[1]; p[2] = pdg[2];
-			for (; _min < _max && z[0][_min] < TINY; ++_min) z[0][_min] = z[1][_min] = 0.;
-			for (; _max > _min && z[0][_max] < TINY; --_max) z[0][_max] = z[1][_max] = 0.;
+	// z[0] is normalized lazily: each step divides p[] by the previous sum, and only the final z and z1 are rescaled
+	for (_j = beg; _j < ma->n; ++_j) {
+		int j = _j - beg, _min = last_min, _max = last_max, M0 = M, ploidy = ma->ploidy? ma->ploidy[_j] : 2;
+		double p[3], thres = TINY * sum, r = 1. / sum;
+		pdg = ma->pdg + _j * 3;
+		for (; _min < _max && z[0][_min] < thres; ++_min) z[0][_min] = z[1][_min] = 0.;
+		for (; _max > _min && z[0][_max] < thres; --_max) z[0][_max] = z[1][_max] = 0.;
+		M += ploidy;
+		if (ploidy == 2) { // the common case; for an all-diploid cohort this is the only branch taken
+			p[0] = pdg[0] * r; p[1] = 2. * pdg[1] * r; p[2] = pdg[2] * r;
 			_max += 2;
-			if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-			if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
-			for (k = _min < 2? 2 : _min; k <= _max; ++k)
-				z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-			for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+			sum = g_mc_step2(z[0], z[1], M0, _min, _max, p);
 			ma->t += log(sum / (M * (M - 1.)));
-			for (k = _min; k <= _max; ++k) z[1][k] /= sum;
 			if (_min >= 1) z[1][_min-1] = 0.;
 			if (_min >= 2) z[1][_min-2] = 0.;
 			if (j < ma->n - 1) z[1][_max+1] = z[1][_max+2] = 0.;
-			if (_j == ma->n1 - 1) { // set pop1; ma->n1==-1 when unset
-				ma->t1 = ma->t;
-				memcpy(ma->z1, z[1], sizeof(double) * (ma->n1 * 2 + 1));
-			}
-			tmp = z[0]; z[0] = z[1]; z[1] = tmp;
-			last_min = _min; last_max = _max;
-		}
-		//for (_j = 0; _j < last_min; ++_j) z[0][_j] = 0.; // TODO: are these necessary?
-		//for (_j = last_max + 1; _j < ma->M; ++_j) z[0][_j] = 0.;
-	} else { // this block is very similar to the block above; these two might be merged in future
-		int j, M = 0;
-		for (j = 0; j < ma->n; ++j) {
-			int k, M0, _min = last_min, _max = last_max;
-			double p[3], sum;
-			pdg = ma->pdg + j * 3;
-			for (; _min < _max && z[0][_min] < TINY; ++_min) z[0][_min] = z[1][_min] = 0.;
-			for (; _max > _min && z[0][_max] < TINY; --_max) z[0][_max] = z[1][_max] = 0.;
-			M0 = M;
-			M += ma->ploidy[j];
-			if (ma->ploidy[j] == 1) {
-				p[0] = pdg[0]; p[1] = pdg[2];
-				_max++;
-				if (_min == 0) k = 0, z[1][k] = (M0+1-k) * p[0] * z[0][k];
-				for (k = _min < 1? 1 : _min; k <= _max; ++k)
-					z[1][k] = (M0+1-k) * p[0] * z[0][k] + k * p[1] * z[0][k-1];
-				for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
-				ma->t += log(sum / M);
-				for (k = _min; k <= _max; ++k) z[1][k] /= sum;
-				if (_min >= 1) z[1][_min-1] = 0.;
-				if (j < ma->n - 1) z[1][_max+1] = 0.;
-			} else if (ma->ploidy[j] == 2) {
-				p[0] = pdg[0]; p[1] = 2 * pdg[1]; p[2] = pdg[2];
-				_max += 2;
-				if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-				if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
-				for (k = _min < 2? 2 : _min; k <= _max; ++k)
-					z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-				for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
-				ma->t += log(sum / (M * (M - 1.)));
-				for (k = _min; k <= _max; ++k) z[1][k] /= sum;
-				if (_min >= 1) z[1][_min-1] = 0.;
-				if (_min >= 2) z[1][_min-2] = 0.;
-				if (j < ma->n - 1) z[1][_max+1] = z[1][_max+2] = 0.;
-			}
-			tmp = z[0]; z[0] = z[1]; z[1] = tmp;
-			last_min = _min; last_max = _max;
+		} else if (ploidy == 1) {
+			p[0] = pdg[0] * r; p[1] = pdg[2] * r;
+			_max++;
+			sum = mc_cal_y_step1(z[0], z[1], M0, _min, _max, p);
+			ma->t += log(sum / M);
+			if (_min >= 1) z[1][_min-1] = 0.;
+			if (j < ma->n - 1) z[1][_max+1] = 0.;
+		} else continue; // z[0] and sum are carried over unchanged
+		if (_j == ma->n1 - 1) { // set pop1; ma->n1==-1 when unset
+			ma->t1 = ma->t;
+			for (k = 0; k <= ma->n1 * 2; ++k) ma->z1[k] = z[1][k] / sum;
 		}
+		tmp = z[0]; z[0] = z[1]; z[1] = tmp;
+		last_min = _min; last_max = _max;
 	}
+	for (k = last_min; k <= last_max; ++k) z[0][k] /= sum;
 	if (z[0] != ma->z) memcpy(ma->z, z[0], sizeof(double) * (ma->M + 1));
 	if (bcf_p1_fp_lk)
 		gzwrite(bcf_p1_fp_lk, ma->z, sizeof(double) * (ma->M + 1));
@@ -913,7 +1004,7 @@ int bcf_p1_cal(const bcf1_t *b, int do_contrast, bcf_p1aux_t *ma, bcf_p1rst_t *r
 	int i, k;
 	long double sum = 0.;
 	ma->is_indel = bcf_is_indel(b);
-	rst->perm_rank = -1;
+	rst->perm_rank = -1; rst->perm_n = 0;
 	// set PL and PL_len
 	for (i = 0; i < b->n_gi; ++i) {
 		if (b->gi[i].fmt == bcf_str2int("PL", 2)) {
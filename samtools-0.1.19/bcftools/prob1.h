@@ -6,8 +6,12 @@
 struct __bcf_p1aux_t;
 typedef struct __bcf_p1aux_t bcf_p1aux_t;
 
+struct __bcf_em_t;
+typedef struct __bcf_em_t bcf_em_t;
+
 typedef struct {
 	int rank0, perm_rank; // NB: perm_rank is always set to -1 by bcf_p1_cal()
+	int perm_n; // # permutations performed if they were stopped early; 0 otherwise
 	int ac; // ML alternative allele count
 	double f_exp, f_flat, p_ref_folded, p_ref, p_var_folded, p_var;
 	double cil, cih;
@@ -31,6 +35,10 @@ extern "C" {
 	void bcf_p1_init_prior(bcf_p1aux_t *ma, int type, double theta);
 	void bcf_p1_init_subprior(bcf_p1aux_t *ma, int type, double theta);
 	void bcf_p1_destroy(bcf_p1aux_t *ma);
+	// copy ma, with an empty AFS, for use by another thread
+	bcf_p1aux_t *bcf_p1_dup(const bcf_p1aux_t *ma);
+	// add the AFS accumulated by src to that of ma and clear it in src
+	void bcf_p1_merge_afs(bcf_p1aux_t *ma, bcf_p1aux_t *src);
     void bcf_p1_set_ploidy(bcf1_t *b, bcf_p1aux_t *ma);
 	int bcf_p1_cal(const bcf1_t *b, int do_contrast, bcf_p1aux_t *ma, bcf_p1rst_t *rst);
     int call_multiallelic_gt(bcf1_t *b, bcf_p1aux_t *ma, double threshold, int var_only);
@@ -41,6 +49,19 @@ extern "C" {
 	void bcf_p1_set_folded(bcf_p1aux_t *p1a); // only effective when set_n1() is not called
 
 	int bcf_em1(const bcf1_t *b, int n1, int flag, double x[10]);
+	// buffers of bcf_em1_r(), reused across records; one per thread
+	bcf_em_t *bcf_em_init(void);
+	void bcf_em_destroy(bcf_em_t *em);
+	int bcf_em1_r(bcf_em_t *em, const bcf1_t *b, int n1, int flag, double x[10]);
+
+	// add the INFO and FORMAT definitions of "bcftools view" to h->txt
+	void bcf_vc_header(bcf_hdr_t *h);
+	/* Call b in place as "bcftools view -cg" (-vcg if var_only) with the
+	   default model; p1 and em must not be shared among threads. Return 0
+	   if b is dropped. */
+	int bcf_vc_call1(bcf1_t *b, bcf_p1aux_t *p1, bcf_em_t *em, double pref, int var_only);
+	// QUAL "bcftools view -cg" gives b if b is not a variant; b is not changed
+	double bcf_vc_ref_qual(const bcf1_t *b, bcf_p1aux_t *p1);
 
 #ifdef __cplusplus
 }
@@ -369,6 +369,29 @@ ssize_t bgzf_read(BGZF *fp, void *data, ssize_t length)
     return bytes_read;
 }
 
+ssize_t bgzf_skip(BGZF *fp, ssize_t length)
+{
+	ssize_t bytes_skipped = 0;
+	if (length <= 0) return 0;
+	assert(fp->is_write == 0);
+	while (bytes_skipped < length) { // as bgzf_read(), but only moves block_offset
+		int skip_length, available = fp->block_length - fp->block_offset;
+		if (available <= 0) {
+			if (bgzf_read_block(fp) != 0) return -1;
+			available = fp->block_length - fp->block_offset;
+			if (available <= 0) break;
+		}
+		skip_length = length - bytes_skipped < available? length - bytes_skipped : available;
+		fp->block_offset += skip_length;
+		bytes_skipped += skip_length;
+	}
+	if (fp->block_offset == fp->block_length) {
+		fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+		fp->block_offset = fp->block_length = 0;
+	}
+	return bytes_skipped;
+}
+
 /***** BEGIN: multi-threading *****/
 
 typedef struct {
@@ -103,6 +103,15 @@ extern "C" {
 	 */
 	ssize_t bgzf_read(BGZF *fp, void *data, ssize_t length);
 
+	/**
+	 * Skip bytes in the uncompressed stream, as bgzf_read() without copying
+	 *
+	 * @param fp     BGZF file handler
+	 * @param length number of bytes to skip
+	 * @return       number of bytes actually skipped; 0 on end-of-file and -1 on error
+	 */
+	ssize_t bgzf_skip(BGZF *fp, ssize_t length);
+
 	/**
 	 * Write _length_ bytes from _data_ to the file.
 	 *
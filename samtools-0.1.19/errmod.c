@@ -3,6 +3,12 @@
 #include "ksort.h"
 KSORT_INIT_GENERIC(uint16_t)
 
+#ifdef __GNUC__
+#define errmod_msb(x) (63 - __builtin_clzll(x))
+#else
+static inline int errmod_msb(uint64_t x) { int r = 0; while (x >>= 1) ++r; return r; }
+#endif
+
 typedef struct __errmod_coef_t {
 	double *fk, *beta, *lhet;
 } errmod_coef_t;
@@ -70,8 +76,8 @@ void errmod_destroy(errmod_t *em)
 	free(em->coef->lhet); free(em->coef->fk); free(em->coef->beta);
 	free(em->coef); free(em);
 }
-// qual:6, strand:1, base:4
-int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
+// qual:6, strand:1, base:4; the values of bases[] are thus below 2048
+int errmod_cal_r(const errmod_t *em, int n, int m, uint16_t *bases, float *q, uint64_t *rng)
 {
 	call_aux_t aux;
 	int i, j, k, w[32];
@@ -81,21 +87,36 @@ int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
 	if (n == 0) return 0;
 	// calculate aux.esum and aux.fsum
 	if (n > 255) { // then sample 255 bases
-		ks_shuffle(uint16_t, n, bases);
+		if (rng) ks_shuffle_r(uint16_t, n, bases, rng);
+		else ks_shuffle(uint16_t, n, bases);
 		n = 255;
 	}
-	ks_introsort(uint16_t, n, bases);
 	memset(w, 0, 32 * sizeof(int));
 	memset(&aux, 0, sizeof(call_aux_t));
-	for (j = n - 1; j >= 0; --j) { // calculate esum and fsum
-		uint16_t b = bases[j];
-		int q = b>>5 < 4? 4 : b>>5;
-		if (q > 63) q = 63;
-		k = b&0x1f;
-		aux.fsum[k&0xf] += em->coef->fk[w[k]];
-		aux.bsum[k&0xf] += em->coef->fk[w[k]] * em->coef->beta[q<<16|n<<8|aux.c[k&0xf]];
-		++aux.c[k&0xf];
-		++w[k];
+	{ // calculate esum and fsum, visiting the bases in descending order; a histogram of the 11-bit values replaces sorting
+		uint64_t nz[32]; // bit b&63 of nz[b>>6]: cnt[b] is set
+		uint8_t cnt[2048];
+		memset(nz, 0, sizeof(nz));
+		for (j = 0; j < n; ++j) {
+			uint16_t b = bases[j];
+			if (nz[b>>6] >> (b&63) & 1) ++cnt[b];
+			else nz[b>>6] |= 1ULL << (b&63), cnt[b] = 1;
+		}
+		for (i = 31; i >= 0; --i) {
+			while (nz[i]) {
+				int x = errmod_msb(nz[i]), b = i<<6 | x, c = cnt[b];
+				int q = b>>5 < 4? 4 : b>>5;
+				if (q > 63) q = 63;
+				k = b&0x1f;
+				nz[i] &= ~(1ULL << x);
+				for (; c > 0; --c) {
+					aux.fsum[k&0xf] += em->coef->fk[w[k]];
+					aux.bsum[k&0xf] += em->coef->fk[w[k]] * em->coef->beta[q<<16|n<<8|aux.c[k&0xf]];
+					++aux.c[k&0xf];
+					++w[k];
+				}
+			}
+		}
 	}
 	// generate likelihood
 	for (j = 0; j != m; ++j) {
@@ -128,3 +149,8 @@ int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
 	}
 	return 0;
 }
+
+int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
+{
+	return errmod_cal_r(em, n, m, bases, q, 0);
+}
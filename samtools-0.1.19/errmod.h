@@ -20,5 +20,7 @@ void errmod_destroy(errmod_t *em);
 	q[i*m+j]: phred-scaled likelihood of (i,j)
  */
 int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q);
+// as errmod_cal(), but beyond 255 bases downsample with ks_drand48_r(rng), not drand48()
+int errmod_cal_r(const errmod_t *em, int n, int m, uint16_t *bases, float *q, uint64_t *rng);
 
 #endif
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <pthread.h>
 #include "kprobaln.h"
 
 /*****************************************
@@ -41,6 +42,34 @@ static float g_qual2prob[256];
 
 #define set_u(u, b, i, k) { int x=(i)-(b); x=x>0?x:0; (u)=((k)-x+1)*3; }
 
+struct __kpa_buf_t {
+	size_t m;
+	uint8_t *mem;
+};
+
+kpa_buf_t *kpa_buf_init(void)
+{
+	return calloc(1, sizeof(kpa_buf_t));
+}
+
+void kpa_buf_destroy(kpa_buf_t *buf)
+{
+	if (buf == 0) return;
+	free(buf->mem); free(buf);
+}
+
+// a zero-filled block of size bytes; the buffer only grows, so there is no heap traffic in the steady state
+static void *kpa_buf_get(kpa_buf_t *buf, size_t size)
+{
+	if (size > buf->m) {
+		buf->m = size + (size>>1);
+		free(buf->mem);
+		buf->mem = malloc(buf->m);
+	}
+	memset(buf->mem, 0, size);
+	return buf->mem;
+}
+
 kpa_par_t kpa_par_def = { 0.001, 0.1, 10 };
 kpa_par_t kpa_par_alt = { 0.0001, 0.01, 10 };
 
@@ -69,16 +98,14 @@ kpa_par_t kpa_par_alt = { 0.0001, 0.01, 10 };
    insertion). q[i] gives the phred scaled posterior probability of
    state[i] being wrong.
  */
-int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
-			   const kpa_par_t *c, int *state, uint8_t *q)
+static int kpa_glocal_scalar(kpa_buf_t *buf, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
+							 const kpa_par_t *c, int *state, uint8_t *q)
 {
 	double **f, **b = 0, *s, m[9], sI, sM, bI, bM, pb;
 	float *qual, *_qual;
 	const uint8_t *ref, *query;
 	int bw, bw2, i, k, is_diff = 0, is_backward = 1, Pr;
 
-    if ( l_ref<=0 || l_query<=0 ) return 0; // FIXME: this may not be an ideal fix, just prevents sefgault
-
 	/*** initialization ***/
 	is_backward = state && q? 1 : 0;
 	ref = _ref - 1; query = _query - 1; // change to 1-based coordinate
@@ -86,19 +113,20 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 	if (bw > c->bw) bw = c->bw;
 	if (bw < abs(l_ref - l_query)) bw = abs(l_ref - l_query);
 	bw2 = bw * 2 + 1;
-	// allocate the forward and backward matrices f[][] and b[][] and the scaling array s[]
-	f = calloc(l_query+1, sizeof(void*));
-	if (is_backward) b = calloc(l_query+1, sizeof(void*));
-	for (i = 0; i <= l_query; ++i) {    // FIXME: this will lead in segfault for l_query==0
-		f[i] = calloc(bw2 * 3 + 6, sizeof(double)); // FIXME: this is over-allocated for very short seqs
-		if (is_backward) b[i] = calloc(bw2 * 3 + 6, sizeof(double));
+	{ // take the forward and backward matrices f[][] and b[][], the scaling array s[] and _qual[] from buf
+		// without the backward pass, f[] only needs two rows, which are reused
+		size_t row = bw2 * 3 + 6, n_ptr = (size_t)(l_query + 1) * (is_backward? 2 : 1), n_row = is_backward? n_ptr : 2; // FIXME: this is over-allocated for very short seqs
+		double *p = kpa_buf_get(buf, (n_row * row + l_query + 2) * sizeof(double) + n_ptr * sizeof(void*) + l_query * sizeof(float));
+		s = p + n_row * row; // s[] is the scaling factor to avoid underflow
+		f = (double**)(s + l_query + 2);
+		if (is_backward) b = f + l_query + 1;
+		_qual = (float*)(f + n_ptr);
+		for (i = 0; i <= l_query; ++i) {
+			f[i] = p + (is_backward? i : i&1) * row;
+			if (is_backward) b[i] = p + (l_query + 1 + i) * row;
+		}
 	}
-	s = calloc(l_query+2, sizeof(double)); // s[] is the scaling factor to avoid underflow
 	// initialize qual
-	_qual = calloc(l_query, sizeof(float));
-	if (g_qual2prob[0] == 0)
-		for (i = 0; i < 256; ++i)
-			g_qual2prob[i] = pow(10, -i/10.);
 	for (i = 0; i < l_query; ++i) _qual[i] = g_qual2prob[iqual? iqual[i] : 30];
 	qual = _qual - 1;
 	// initialize transition probability
@@ -133,6 +161,10 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 		uint8_t qyi = query[i];
 		x = i - bw; beg = beg > x? beg : x; // band start
 		x = i + bw; end = end < x? end : x; // band end
+		if (!is_backward) { // a reused row: clear the cells next to the band, the only ones read outside it
+			set_u(_beg, bw, i, beg); set_u(_end, bw, i, end);
+			fi[_beg-3] = fi[_beg-2] = fi[_beg-1] = fi[_end+3] = fi[_end+4] = fi[_end+5] = 0.;
+		}
 		for (k = beg, sum = 0.; k <= end; ++k) {
 			int u, v11, v01, v10;
 			double e;
@@ -151,7 +183,8 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 	}
 	{ // f[l_query+1]
 		double sum;
-		for (k = 1, sum = 0.; k <= l_ref; ++k) {
+		int end = l_query + bw < l_ref? l_query + bw : l_ref;
+		for (k = l_query - bw > 1? l_query - bw : 1, sum = 0.; k <= end; ++k) { // cells out of the band are zero or stale
 			int u;
 			set_u(u, bw, l_query, k);
 			if (u < 3 || u >= bw2*3+3) continue;
@@ -167,11 +200,7 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 		}
 		Pr1 += -4.343 * log(p * l_ref * l_query);
 		Pr = (int)(Pr1 + .499);
-		if (!is_backward) { // skip backward and MAP
-			for (i = 0; i <= l_query; ++i) free(f[i]);
-			free(f); free(s); free(_qual);
-			return Pr;
-		}
+		if (!is_backward) return Pr; // skip backward and MAP
 	}
 	/*** backward ***/
 	// b[l_query] (b[l_query+1][0]=1 and thus \tilde{b}[][]=1/s[l_query+1]; this is where s[l_query+1] comes from)
@@ -238,14 +267,99 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 				"ACGT"[query[i]], "ACGT"[ref[(max_k>>2)+1]], max_k&3, max); // DEBUG
 #endif
 	}
-	/*** free ***/
-	for (i = 0; i <= l_query; ++i) {
-		free(f[i]); free(b[i]);
-	}
-	free(f); free(b); free(s); free(_qual);
 	return Pr;
 }
 
+/*** vectorized kernels and runtime dispatch ***/
+
+typedef int (*kpa_glocal_f)(kpa_buf_t*, const uint8_t*, int, const uint8_t*, int, const uint8_t*, const kpa_par_t*, int*, uint8_t*);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KPA_SIMD
+
+// SSE2 is part of x86-64; on plain i386 the compiler lowers the vectors to scalar code
+#define KPA_REAL double
+#define KPA_W 2
+#define KPA_FUNC kpa_glocal_sse2
+#define KPA_ATTR
+#include "kprobaln_band.h"
+
+#define KPA_REAL float
+#define KPA_W 4
+#define KPA_FUNC kpa_glocal_sse2_fp32
+#define KPA_ATTR
+#include "kprobaln_band.h"
+
+#define KPA_REAL double
+#define KPA_W 4
+#define KPA_FUNC kpa_glocal_avx2
+#define KPA_ATTR __attribute__((target("avx2")))
+#include "kprobaln_band.h"
+
+#define KPA_REAL float
+#define KPA_W 8
+#define KPA_FUNC kpa_glocal_avx2_fp32
+#define KPA_ATTR __attribute__((target("avx2")))
+#include "kprobaln_band.h"
+#endif
+
+static int g_kpa_simd = KPA_SIMD_DOUBLE;
+static kpa_glocal_f g_kpa_glocal;
+static pthread_once_t g_kpa_once = PTHREAD_ONCE_INIT;
+
+static void kpa_init(void)
+{
+	kpa_glocal_f f = kpa_glocal_scalar;
+	int i;
+	if (g_qual2prob[0] == 0)
+		for (i = 0; i < 256; ++i)
+			g_qual2prob[i] = pow(10, -i/10.);
+#ifdef KPA_SIMD
+	if (g_kpa_simd != KPA_SIMD_SCALAR) {
+		int avx2 = __builtin_cpu_supports("avx2");
+		if (g_kpa_simd == KPA_SIMD_FLOAT) f = avx2? kpa_glocal_avx2_fp32 : kpa_glocal_sse2_fp32;
+		else f = avx2? kpa_glocal_avx2 : kpa_glocal_sse2;
+	}
+#endif
+	g_kpa_glocal = f;
+}
+
+void kpa_set_simd(int mode)
+{
+	g_kpa_simd = mode;
+	kpa_init();
+}
+
+int kpa_glocal_buf(kpa_buf_t *buf, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
+				   const kpa_par_t *c, int *state, uint8_t *q)
+{
+	int ret;
+    if ( l_ref<=0 || l_query<=0 ) return 0; // FIXME: this may not be an ideal fix, just prevents sefgault
+	pthread_once(&g_kpa_once, kpa_init); // BAQ may be computed by several threads
+	if (buf) return g_kpa_glocal(buf, _ref, l_ref, _query, l_query, iqual, c, state, q);
+	buf = kpa_buf_init();
+	ret = g_kpa_glocal(buf, _ref, l_ref, _query, l_query, iqual, c, state, q);
+	kpa_buf_destroy(buf);
+	return ret;
+}
+
+void kpa_glocal_score(kpa_buf_t *buf, int n, const uint8_t *const *ref, const int *l_ref, const uint8_t *query, int l_query,
+					  const uint8_t *iqual, const kpa_par_t *c, int *score)
+{
+	int h, is_tmp = (buf == 0);
+	pthread_once(&g_kpa_once, kpa_init);
+	if (is_tmp) buf = kpa_buf_init();
+	for (h = 0; h < n; ++h) // forward only: each haplotype takes two rows of buf
+		score[h] = l_ref[h] <= 0 || l_query <= 0? 0 : g_kpa_glocal(buf, ref[h], l_ref[h], query, l_query, iqual, &c[h], 0, 0);
+	if (is_tmp) kpa_buf_destroy(buf);
+}
+
+int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
+			   const kpa_par_t *c, int *state, uint8_t *q)
+{
+	return kpa_glocal_buf(0, _ref, l_ref, _query, l_query, iqual, c, state, q);
+}
+
 #ifdef _MAIN
 #include <unistd.h>
 int main(int argc, char *argv[])
@@ -33,13 +33,30 @@ typedef struct {
 	int bw;
 } kpa_par_t;
 
+// kernels used by kpa_glocal(); the vectorized ones are picked at runtime by the CPU features
+#define KPA_SIMD_SCALAR 0 // the reference double-precision implementation
+#define KPA_SIMD_DOUBLE 1 // vectorized, double precision (default)
+#define KPA_SIMD_FLOAT  2 // vectorized, single precision; q[] may differ by one from the above
+
+typedef struct __kpa_buf_t kpa_buf_t; // reusable workspace of kpa_glocal_buf(); not thread-safe
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+	void kpa_set_simd(int mode);
 	int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
 				   const kpa_par_t *c, int *state, uint8_t *q);
 
+	kpa_buf_t *kpa_buf_init(void);
+	void kpa_buf_destroy(kpa_buf_t *buf);
+	// kpa_glocal() with its matrices taken from buf; a temporary workspace is used if buf is NULL
+	int kpa_glocal_buf(kpa_buf_t *buf, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
+					   const kpa_par_t *c, int *state, uint8_t *q);
+	// score[h] = kpa_glocal(ref[h], l_ref[h], query, l_query, iqual, &c[h], 0, 0) for each of n haplotypes
+	void kpa_glocal_score(kpa_buf_t *buf, int n, const uint8_t *const *ref, const int *l_ref, const uint8_t *query, int l_query,
+						  const uint8_t *iqual, const kpa_par_t *c, int *score);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,252 @@
+/* Vectorized banded forward/backward for kpa_glocal(); included by kprobaln.c.
+
+   Before inclusion, define
+     KPA_REAL  the floating-point type of the DP matrices (double or float)
+     KPA_W     the number of KPA_REAL lanes in a vector
+     KPA_FUNC  the name of the function to generate
+     KPA_ATTR  function attributes, e.g. __attribute__((target("avx2")))
+
+   Unlike the scalar kpa_glocal(), each row of M/I/D is stored in a separate
+   array (structure of arrays) indexed by j=k-x+1, where x=max(i-bw,0) is
+   the band offset of row i. M and I only depend on the previous row, so
+   they are computed KPA_W cells at a time; D is a recurrence along the row
+   and is swept afterwards in blocks of four, so that only one multiply-add
+   per block is on the critical path. Cells outside the band stay zero as
+   in the scalar version. Rows are rescaled as before, which keeps float
+   matrices away from underflow; the scaling factors and the likelihood
+   are always accumulated in double. Without state and q, only the
+   likelihood is wanted and the forward pass runs on two rolling rows.
+ */
+
+#define KPA_VEC KPA_CAT(kpa_vec_, KPA_FUNC)
+#define KPA_CAT(a, b) KPA_CAT2(a, b)
+#define KPA_CAT2(a, b) a ## b
+
+typedef KPA_REAL KPA_VEC __attribute__((vector_size(sizeof(KPA_REAL) * KPA_W)));
+
+#define vload(v, p) memcpy(&(v), (p), sizeof(KPA_VEC))
+#define vstore(p, v) memcpy((p), &(v), sizeof(KPA_VEC))
+
+KPA_ATTR static int KPA_FUNC(kpa_buf_t *buf, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
+							 const kpa_par_t *c, int *state, uint8_t *q)
+{
+	KPA_REAL *fM, *fI, *fD, *bM_, *bI_, *bD_, *e, m[9], bM, bI, sM, sI, etab[6];
+	double *s;
+	float *qual, *_qual;
+	uint8_t *ref;
+	const uint8_t *query;
+	int bw, bw2, w, i, j, k, is_backward, Pr;
+	size_t n_row;
+
+	/*** initialization ***/
+	is_backward = state && q? 1 : 0;
+	query = _query - 1;
+	bw = l_ref > l_query? l_ref : l_query;
+	if (bw > c->bw) bw = c->bw;
+	if (bw < abs(l_ref - l_query)) bw = abs(l_ref - l_query);
+	bw2 = bw * 2 + 1;
+	w = (bw2 + 2 + KPA_W - 1) / KPA_W * KPA_W; // row stride; j in [0,bw2+1]
+	n_row = is_backward? l_query + 1 : 2; // forward rows are reused if there is no backward pass
+#define KPA_ROW(i) ((size_t)(is_backward? (i) : (i)&1) * w)
+	{ // s[], the matrices, _qual[] and the clipped reference, in this order, all from buf
+		size_t n_mat = n_row * w * (is_backward? 6 : 3) + w;
+		s = kpa_buf_get(buf, (l_query + 2) * sizeof(double) + n_mat * sizeof(KPA_REAL) + l_query * sizeof(float) + l_ref + 2);
+		fM = (KPA_REAL*)(s + l_query + 2);
+		_qual = (float*)(fM + n_mat);
+		ref = (uint8_t*)(_qual + l_query);
+	}
+	fI = fM + n_row * w; fD = fI + n_row * w;
+	e = fD + n_row * w;
+	if (is_backward) {
+		bM_ = e + w; bI_ = bM_ + (size_t)(l_query + 1) * w; bD_ = bI_ + (size_t)(l_query + 1) * w;
+	} else bM_ = bI_ = bD_ = 0;
+	for (i = 0; i < l_query; ++i) _qual[i] = g_qual2prob[iqual? iqual[i] : 30];
+	qual = _qual - 1;
+	// the emission is looked up in etab[] by the reference base: 4 for ambiguous and 5 past the end
+	for (k = 1; k <= l_ref; ++k) ref[k] = _ref[k-1] > 3? 4 : _ref[k-1];
+	ref[l_ref+1] = 5;
+	sM = sI = 1. / (2 * l_query + 2);
+	m[0*3+0] = (1 - c->d - c->d) * (1 - sM); m[0*3+1] = m[0*3+2] = c->d * (1 - sM);
+	m[1*3+0] = (1 - c->e) * (1 - sI); m[1*3+1] = c->e * (1 - sI); m[1*3+2] = 0.;
+	m[2*3+0] = 1 - c->e; m[2*3+1] = 0.; m[2*3+2] = c->e;
+	bM = (1 - c->d) / l_ref; bI = c->d / l_ref;
+#define set_etab(qy, ql) do { \
+		int _a; \
+		for (_a = 0; _a < 4; ++_a) etab[_a] = (qy) > 3? 1. : _a == (qy)? 1. - (ql) : (ql) * EM; \
+		etab[4] = 1.; etab[5] = 0.; \
+	} while (0)
+	/*** forward ***/
+	fM[1] = s[0] = 1.; // f[0] at k=0
+	{ // f[1]
+		KPA_REAL *fi = fM + w, *fii = fI + w;
+		double sum = 0.;
+		int end = l_ref < bw + 1? l_ref : bw + 1, x = 1 - bw > 0? 1 - bw : 0;
+		set_etab(query[1], qual[1]);
+		for (k = 1; k <= end; ++k) {
+			j = k - x + 1;
+			fi[j] = etab[ref[k]] * bM; fii[j] = EI * bI;
+			sum += fi[j] + fii[j];
+		}
+		s[1] = sum;
+		for (k = 1; k <= end; ++k) j = k - x + 1, fi[j] /= sum, fii[j] /= sum;
+	}
+	// f[2..l_query]
+	for (i = 2; i <= l_query; ++i) {
+		KPA_REAL *fm = fM + KPA_ROW(i), *fi = fI + KPA_ROW(i), *fd = fD + KPA_ROW(i);
+		KPA_REAL *pm = fM + KPA_ROW(i-1), *pi = fI + KPA_ROW(i-1), *pd = fD + KPA_ROW(i-1), r;
+		int beg, end, x, d, jb, je;
+		double sum;
+		beg = i - bw > 1? i - bw : 1;
+		end = i + bw < l_ref? i + bw : l_ref;
+		x = i - bw > 0? i - bw : 0;
+		d = x - (i - 1 - bw > 0? i - 1 - bw : 0); // the band shifts by d from row i-1 to row i
+		jb = beg - x + 1; je = end - x + 1;
+		if (!is_backward) // a reused row: clear the cells next to the band, the only ones read outside it
+			fm[jb-1] = fi[jb-1] = fd[jb-1] = fm[je+1] = fi[je+1] = fd[je+1] = 0.;
+		set_etab(query[i], qual[i]);
+		for (k = beg, j = jb; k <= end; ++k, ++j) e[j] = etab[ref[k]];
+		for (j = jb; j + KPA_W - 1 <= je; j += KPA_W) {
+			KPA_VEC ev, m11, i11, d11, m10, i10, z;
+			vload(ev, e + j);
+			vload(m11, pm + j - 1 + d); vload(i11, pi + j - 1 + d); vload(d11, pd + j - 1 + d);
+			vload(m10, pm + j + d); vload(i10, pi + j + d);
+			z = ev * (m[0] * m11 + m[3] * i11 + m[6] * d11); vstore(fm + j, z);
+			z = (KPA_REAL)EI * (m[1] * m10 + m[4] * i10); vstore(fi + j, z);
+		}
+		for (; j <= je; ++j) {
+			fm[j] = e[j] * (m[0] * pm[j-1+d] + m[3] * pi[j-1+d] + m[6] * pd[j-1+d]);
+			fi[j] = EI * (m[1] * pm[j+d] + m[4] * pi[j+d]);
+		}
+		{ // D[j] = m[2]*M[j-1] + m[8]*D[j-1]; unrolled so that the carried dependency is one step per four cells
+			KPA_REAL b1 = m[8], b2 = b1 * b1, b3 = b2 * b1, b4 = b2 * b2, cd = 0., p0, p1, p2, p3;
+			for (j = jb; j + 3 <= je; j += 4) {
+				p0 = m[2] * fm[j-1];
+				p1 = m[2] * fm[j+0] + b1 * p0;
+				p2 = m[2] * fm[j+1] + b1 * p1;
+				p3 = m[2] * fm[j+2] + b1 * p2;
+				fd[j] = p0 + b1 * cd; fd[j+1] = p1 + b2 * cd; fd[j+2] = p2 + b3 * cd; fd[j+3] = cd = p3 + b4 * cd;
+			}
+			for (; j <= je; ++j) fd[j] = cd = m[2] * fm[j-1] + b1 * cd;
+		}
+		{ // sum and rescale
+			KPA_VEC vs = {0}, vm, vi, vd, vr;
+			for (j = jb; j + KPA_W - 1 <= je; j += KPA_W) {
+				vload(vm, fm + j); vload(vi, fi + j); vload(vd, fd + j);
+				vs += vm + vi + vd;
+			}
+			for (k = 0, sum = 0.; k < KPA_W; ++k) sum += vs[k];
+			for (; j <= je; ++j) sum += fm[j] + fi[j] + fd[j];
+			s[i] = sum; r = 1. / sum;
+			for (j = jb; j + KPA_W - 1 <= je; j += KPA_W) {
+				vload(vm, fm + j); vload(vi, fi + j); vload(vd, fd + j);
+				vr = vm * r; vstore(fm + j, vr); vr = vi * r; vstore(fi + j, vr); vr = vd * r; vstore(fd + j, vr);
+			}
+			for (; j <= je; ++j) fm[j] *= r, fi[j] *= r, fd[j] *= r;
+		}
+	}
+	{ // f[l_query+1]
+		KPA_REAL *fm = fM + KPA_ROW(l_query), *fi = fI + KPA_ROW(l_query);
+		int x = l_query - bw > 0? l_query - bw : 0, end = l_query + bw < l_ref? l_query + bw : l_ref;
+		double sum = 0.;
+		for (k = x > 1? x : 1; k <= end; ++k) { // cells out of the band are zero or stale
+			j = k - x + 1;
+			if (j < 1 || j > bw2) continue;
+			sum += fm[j] * sM + fi[j] * sI;
+		}
+		s[l_query+1] = sum;
+	}
+	{ // compute likelihood
+		double p = 1., Pr1 = 0.;
+		for (i = 0; i <= l_query + 1; ++i) {
+			p *= s[i];
+			if (p < 1e-100) Pr1 += -4.343 * log(p), p = 1.;
+		}
+		Pr1 += -4.343 * log(p * l_ref * l_query);
+		Pr = (int)(Pr1 + .499);
+		if (!is_backward) return Pr;
+	}
+	/*** backward ***/
+	{ // b[l_query]
+		KPA_REAL *bm = bM_ + (size_t)l_query * w, *bi = bI_ + (size_t)l_query * w;
+		int x = l_query - bw > 0? l_query - bw : 0;
+		for (k = 1; k <= l_ref; ++k) {
+			j = k - x + 1;
+			if (j < 1 || j > bw2) continue;
+			bm[j] = sM / s[l_query] / s[l_query+1]; bi[j] = sI / s[l_query] / s[l_query+1];
+		}
+	}
+	// b[l_query-1..1]
+	for (i = l_query - 1; i >= 1; --i) {
+		KPA_REAL *bm = bM_ + (size_t)i * w, *bi = bI_ + (size_t)i * w, *bd = bD_ + (size_t)i * w;
+		KPA_REAL *nm = bm + w, *ni = bi + w, y = (i > 1), r;
+		int beg, end, x, d, jb, je;
+		beg = i - bw > 1? i - bw : 1;
+		end = i + bw < l_ref? i + bw : l_ref;
+		x = i - bw > 0? i - bw : 0;
+		d = (i + 1 - bw > 0? i + 1 - bw : 0) - x; // the band shifts by d from row i to row i+1
+		jb = beg - x + 1; je = end - x + 1;
+		set_etab(query[i+1], qual[i+1]);
+		for (k = beg, j = jb; k <= end; ++k, ++j) e[j] = etab[ref[k+1]];
+		for (j = jb; j + KPA_W - 1 <= je; j += KPA_W) {
+			KPA_VEC ev, m11, i10, z;
+			vload(ev, e + j); vload(m11, nm + j + 1 - d); vload(i10, ni + j - d);
+			ev *= m11; vstore(e + j, ev); // fold b[i+1][k+1] into e[] as the scalar version does
+			z = ev * m[3] + (KPA_REAL)EI * m[4] * i10; vstore(bi + j, z);
+		}
+		for (; j <= je; ++j) {
+			e[j] *= nm[j+1-d];
+			bi[j] = e[j] * m[3] + EI * m[4] * ni[j-d];
+		}
+		{ // D[j] = y*m[6]*e[j] + y*m[8]*D[j+1], swept from the band end
+			KPA_REAL b1 = m[8] * y, b2 = b1 * b1, b3 = b2 * b1, b4 = b2 * b2, u = m[6] * y, cd = 0., p0, p1, p2, p3;
+			for (j = je; j - 3 >= jb; j -= 4) {
+				p0 = u * e[j];
+				p1 = u * e[j-1] + b1 * p0;
+				p2 = u * e[j-2] + b1 * p1;
+				p3 = u * e[j-3] + b1 * p2;
+				bd[j] = p0 + b1 * cd; bd[j-1] = p1 + b2 * cd; bd[j-2] = p2 + b3 * cd; bd[j-3] = cd = p3 + b4 * cd;
+			}
+			for (; j >= jb; --j) bd[j] = cd = u * e[j] + b1 * cd;
+		}
+		r = 1. / s[i];
+		for (j = jb; j + KPA_W - 1 <= je; j += KPA_W) {
+			KPA_VEC ev, i10, d01, z;
+			vload(ev, e + j); vload(i10, ni + j - d); vload(d01, bd + j + 1);
+			z = (ev * m[0] + (KPA_REAL)EI * m[1] * i10 + m[2] * d01) * r; vstore(bm + j, z);
+		}
+		for (; j <= je; ++j) bm[j] = (e[j] * m[0] + EI * m[1] * ni[j-d] + m[2] * bd[j+1]) * r;
+		for (j = jb; j + KPA_W - 1 <= je; j += KPA_W) {
+			KPA_VEC vi, vd;
+			vload(vi, bi + j); vload(vd, bd + j);
+			vi *= r; vd *= r; vstore(bi + j, vi); vstore(bd + j, vd);
+		}
+		for (; j <= je; ++j) bi[j] *= r, bd[j] *= r;
+	}
+	/*** MAP ***/
+	for (i = 1; i <= l_query; ++i) {
+		KPA_REAL *fm = fM + (size_t)i * w, *fi = fI + (size_t)i * w, *bm = bM_ + (size_t)i * w, *bi = bI_ + (size_t)i * w;
+		double sum = 0., max = 0., z;
+		int beg, end, x, max_k = -1;
+		beg = i - bw > 1? i - bw : 1;
+		end = i + bw < l_ref? i + bw : l_ref;
+		x = i - bw > 0? i - bw : 0;
+		for (k = beg, j = beg - x + 1; k <= end; ++k, ++j) {
+			z = (double)fm[j] * bm[j]; if (z > max) max = z, max_k = (k-1)<<2 | 0; sum += z;
+			z = (double)fi[j] * bi[j]; if (z > max) max = z, max_k = (k-1)<<2 | 1; sum += z;
+		}
+		max /= sum;
+		state[i-1] = max_k;
+		k = (int)(-4.343 * log(1. - max) + .499), q[i-1] = k > 100? 99 : k;
+	}
+#undef set_etab
+#undef KPA_ROW
+	return Pr;
+}
+
+#undef vload
+#undef vstore
+#undef KPA_VEC
+#undef KPA_REAL
+#undef KPA_W
+#undef KPA_FUNC
+#undef KPA_ATTR
@@ -63,6 +63,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 typedef struct {
 	void *left, *right;
@@ -71,6 +72,20 @@ typedef struct {
 
 #define KSORT_SWAP(type_t, a, b) { register type_t t=(a); (a)=(b); (b)=t; }
 
+/* drand48() and lrand48() with the 48-bit state in *x instead of a
+   global; srand48(s) is equivalent to *x = ks_srand48_r(s) */
+#define ks_srand48_r(s) ((uint64_t)(uint32_t)(s) << 16 | 0x330e)
+static inline double ks_drand48_r(uint64_t *x)
+{
+	*x = (*x * 0x5deece66dULL + 0xb) & 0xffffffffffffULL;
+	return (double)*x / 281474976710656.0;
+}
+static inline long ks_lrand48_r(uint64_t *x)
+{
+	*x = (*x * 0x5deece66dULL + 0xb) & 0xffffffffffffULL;
+	return (long)(*x >> 17);
+}
+
 #define KSORT_INIT(name, type_t, __sort_lt)								\
 	void ks_mergesort_##name(size_t n, type_t array[], type_t temp[])	\
 	{																	\
@@ -263,6 +278,15 @@ typedef struct {
 			j = (int)(drand48() * i);									\
 			tmp = a[j]; a[j] = a[i-1]; a[i-1] = tmp;					\
 		}																\
+	}																	\
+	void ks_shuffle_r_##name(size_t n, type_t a[], uint64_t *x)			\
+	{																	\
+		int i, j;														\
+		for (i = n; i > 1; --i) {										\
+			type_t tmp;													\
+			j = (int)(ks_drand48_r(x) * i);								\
+			tmp = a[j]; a[j] = a[i-1]; a[i-1] = tmp;					\
+		}																\
 	}
 
 #define ks_mergesort(name, n, a, t) ks_mergesort_##name(n, a, t)
@@ -273,6 +297,7 @@ typedef struct {
 #define ks_heapadjust(name, i, n, a) ks_heapadjust_##name(i, n, a)
 #define ks_ksmall(name, n, a, k) ks_ksmall_##name(n, a, k)
 #define ks_shuffle(name, n, a) ks_shuffle_##name(n, a)
+#define ks_shuffle_r(name, n, a, x) ks_shuffle_r_##name(n, a, x)
 
 #define ks_lt_generic(a, b) ((a) < (b))
 #define ks_lt_str(a, b) (strcmp((a), (b)) < 0)
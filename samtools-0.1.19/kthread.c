@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "kthread.h"
+
+typedef struct {
+	kt_pool_t *p;
+	int tid;
+} kt_worker_t;
+
+struct __kt_pool_t {
+	int n_threads, quit;
+	pthread_t *tid;
+	kt_worker_t *w;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_work, cv_done;
+	// the running loop
+	void (*func)(void*,long,int);
+	void *data;
+	long n, next, n_done;
+};
+
+// take iterations of the current loop until there are none left; called with p->lock held
+static void kt_run(kt_pool_t *p, int tid)
+{
+	while (p->next < p->n) {
+		void (*func)(void*,long,int) = p->func;
+		void *data = p->data;
+		long i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+		func(data, i, tid);
+		pthread_mutex_lock(&p->lock);
+		if (++p->n_done == p->n) pthread_cond_signal(&p->cv_done);
+	}
+}
+
+static void *kt_worker(void *data)
+{
+	kt_worker_t *w = (kt_worker_t*)data;
+	kt_pool_t *p = w->p;
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->quit && p->next >= p->n)
+			pthread_cond_wait(&p->cv_work, &p->lock);
+		if (p->quit) break;
+		kt_run(p, w->tid);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+kt_pool_t *kt_pool_init(int n_threads)
+{
+	kt_pool_t *p;
+	int i;
+	if (n_threads < 1) n_threads = 1;
+	p = calloc(1, sizeof(kt_pool_t));
+	p->n_threads = n_threads;
+	pthread_mutex_init(&p->lock, 0);
+	pthread_cond_init(&p->cv_work, 0);
+	pthread_cond_init(&p->cv_done, 0);
+	p->tid = calloc(n_threads, sizeof(pthread_t));
+	p->w = calloc(n_threads, sizeof(kt_worker_t));
+	for (i = 1; i < n_threads; ++i) {
+		p->w[i].p = p, p->w[i].tid = i;
+		pthread_create(&p->tid[i], 0, kt_worker, &p->w[i]);
+	}
+	return p;
+}
+
+void kt_pool_destroy(kt_pool_t *p)
+{
+	int i;
+	if (p == 0) return;
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->cv_work);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 1; i < p->n_threads; ++i) pthread_join(p->tid[i], 0);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cv_work);
+	pthread_cond_destroy(&p->cv_done);
+	free(p->tid); free(p->w); free(p);
+}
+
+int kt_pool_size(const kt_pool_t *p)
+{
+	return p? p->n_threads : 1;
+}
+
+void kt_pool_for(kt_pool_t *p, void (*func)(void*,long,int), void *data, long n)
+{
+	long i;
+	if (n <= 0) return;
+	if (p == 0 || p->n_threads == 1 || n == 1) {
+		for (i = 0; i < n; ++i) func(data, i, 0);
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->func = func, p->data = data;
+	p->n = n, p->next = p->n_done = 0;
+	pthread_cond_broadcast(&p->cv_work);
+	kt_run(p, 0);
+	while (p->n_done < p->n)
+		pthread_cond_wait(&p->cv_done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,25 @@
+#ifndef KTHREAD_H
+#define KTHREAD_H
+
+/* A fixed pool of threads for parallel loops. The calling thread takes part
+   in each loop as thread 0; the others are numbered 1..n_threads-1, so that
+   func() can index per-thread workspaces by tid. */
+
+typedef struct __kt_pool_t kt_pool_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	kt_pool_t *kt_pool_init(int n_threads);
+	void kt_pool_destroy(kt_pool_t *p);
+	int kt_pool_size(const kt_pool_t *p);
+	// call func(data, i, tid) for i in [0,n) and return when all calls are done;
+	// p may be NULL; one loop at a time per pool
+	void kt_pool_for(kt_pool_t *p, void (*func)(void*,long,int), void *data, long n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,6 +25,13 @@ void bam_smpl_destroy(bam_sample_t *sm)
 		if (kh_exist(rg2smid, k)) free((char*)kh_key(rg2smid, k));
 	kh_destroy(sm, sm->rg2smid);
 	kh_destroy(sm, sm->sm2id);
+	for (i = 0; i < sm->n_file; ++i) {
+		khash_t(sm) *h = (khash_t(sm)*)sm->file_rg2smid[i];
+		for (k = kh_begin(h); k != kh_end(h); ++k)
+			if (kh_exist(h, k)) free((char*)kh_key(h, k));
+		kh_destroy(sm, h);
+	}
+	free(sm->file_rg2smid); free(sm->file_smid);
 	free(sm);
 }
 
@@ -49,14 +56,29 @@ static void add_pair(bam_sample_t *sm, khash_t(sm) *sm2id, const char *key, cons
 	kh_val(rg2smid, k_rg) = kh_val(sm2id, k_sm);
 }
 
+static khash_t(sm) *add_file(bam_sample_t *sm)
+{
+	if (sm->n_file == sm->m_file) {
+		sm->m_file = sm->m_file? sm->m_file<<1 : 4;
+		sm->file_rg2smid = realloc(sm->file_rg2smid, sizeof(void*) * sm->m_file);
+		sm->file_smid = realloc(sm->file_smid, sizeof(int) * sm->m_file);
+	}
+	sm->file_smid[sm->n_file] = -1;
+	return (khash_t(sm)*)(sm->file_rg2smid[sm->n_file++] = kh_init(sm));
+}
+
 int bam_smpl_add(bam_sample_t *sm, const char *fn, const char *txt)
 {
 	const char *p = txt, *q, *r;
 	kstring_t buf, first_sm;
-	int n = 0;
+	int n = 0, ret;
+	khint_t k;
 	khash_t(sm) *sm2id = (khash_t(sm)*)sm->sm2id;
+	khash_t(sm) *rg2smid = (khash_t(sm)*)sm->rg2smid;
+	khash_t(sm) *file_rg2smid = add_file(sm);
 	if (txt == 0) {
 		add_pair(sm, sm2id, fn, fn);
+		sm->file_smid[sm->n_file-1] = bam_smpl_rg2smid(sm, fn, 0, 0);
 		return 0;
 	}
 	memset(&buf, 0, sizeof(kstring_t));
@@ -74,6 +96,11 @@ int bam_smpl_add(bam_sample_t *sm, const char *fn, const char *txt)
 			oq = *u; or = *v; *u = *v = '\0';
 			buf.l = 0; kputs(fn, &buf); kputc('/', &buf); kputs(q, &buf);
 			add_pair(sm, sm2id, buf.s, r);
+			k = kh_get(sm, file_rg2smid, q);
+			if (k == kh_end(file_rg2smid)) { // the same id as the "fn/RG" key, which may have been added before
+				k = kh_put(sm, file_rg2smid, strdup(q), &ret);
+				kh_val(file_rg2smid, k) = kh_val(rg2smid, kh_get(sm, rg2smid, buf.s));
+			}
             if ( !first_sm.s )
                 kputs(r,&first_sm); 
 			*u = oq; *v = or;
@@ -90,6 +117,7 @@ int bam_smpl_add(bam_sample_t *sm, const char *fn, const char *txt)
         free(first_sm.s);
 
 //	add_pair(sm, sm2id, fn, fn);
+	sm->file_smid[sm->n_file-1] = bam_smpl_rg2smid(sm, fn, 0, 0);
 	free(buf.s);
 	return 0;
 }
@@ -105,3 +133,13 @@ int bam_smpl_rg2smid(const bam_sample_t *sm, const char *fn, const char *rg, kst
 	} else k = kh_get(sm, rg2smid, fn);
 	return k == kh_end(rg2smid)? -1 : kh_val(rg2smid, k);
 }
+
+int bam_smpl_file2smid(const bam_sample_t *sm, int file, const char *rg)
+{
+	if (rg) {
+		khash_t(sm) *h = (khash_t(sm)*)sm->file_rg2smid[file];
+		khint_t k = kh_get(sm, h, rg);
+		if (k != kh_end(h)) return kh_val(h, k);
+	}
+	return sm->file_smid[file];
+}
@@ -7,11 +7,17 @@ typedef struct {
 	int n, m;
 	char **smpl;
 	void *rg2smid, *sm2id;
+	// per input file, in the order of bam_smpl_add() calls
+	int n_file, m_file;
+	void **file_rg2smid; // @RG-ID -> sample id; no file name in the key
+	int *file_smid; // sample id of reads without a known RG, or -1
 } bam_sample_t;
 
 bam_sample_t *bam_smpl_init(void);
 int bam_smpl_add(bam_sample_t *sm, const char *abs, const char *txt);
 int bam_smpl_rg2smid(const bam_sample_t *sm, const char *fn, const char *rg, kstring_t *str);
+// same as bam_smpl_rg2smid() with the fallback to rg==0, for the file-th file added; no string is built
+int bam_smpl_file2smid(const bam_sample_t *sm, int file, const char *rg);
 void bam_smpl_destroy(bam_sample_t *sm);
 
 #endif